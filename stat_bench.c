@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/*
+ * Scaling of the lookup, permission and read paths: each of N threads
+ * stats (or opens and closes, or preads) the same path in a loop for a
+ * few seconds, for N = 1, 2, 4, ... up to the -t limit.  Run it on a
+ * deep path inside the wrapfs mount and on the same path in the lower
+ * file system to compare.
+ */
+
+#define BUFLEN 4096
+
+enum { MODE_STAT, MODE_OPEN, MODE_READ };
+
+static const char *path;
+static int mode = MODE_STAT;
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	unsigned long ops;
+	int err;
+};
+
+static void *run(void *arg)
+{
+	struct worker *w = arg;
+	char buf[BUFLEN];
+	struct stat st;
+	int fd = -1;
+
+	if (mode == MODE_READ) {
+		fd = open(path, O_RDONLY);
+		if (fd == -1) {
+			w->err = 1;
+			return NULL;
+		}
+	}
+	while (!stop) {
+		switch (mode) {
+		case MODE_STAT:
+			if (stat(path, &st) == -1)
+				w->err = 1;
+			break;
+		case MODE_OPEN:
+			fd = open(path, O_RDONLY);
+			if (fd == -1)
+				w->err = 1;
+			else
+				close(fd);
+			break;
+		case MODE_READ:
+			if (pread(fd, buf, BUFLEN, 0) == -1)
+				w->err = 1;
+			break;
+		}
+		if (w->err)
+			break;
+		w->ops++;
+	}
+	if (mode == MODE_READ)
+		close(fd);
+	return NULL;
+}
+
+/* ops per second of @nr threads running for @secs seconds */
+static double bench(int nr, int secs)
+{
+	struct worker *workers;
+	struct timeval start, end;
+	unsigned long ops = 0;
+	double elapsed;
+	int i, err = 0;
+
+	workers = calloc(nr, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		exit(1);
+	}
+	stop = 0;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nr; i++)
+		if (pthread_create(&workers[i].thread, NULL, run,
+				   &workers[i])) {
+			fprintf(stderr, "cannot start thread %d\n", i);
+			exit(1);
+		}
+	sleep(secs);
+	stop = 1;
+	for (i = 0; i < nr; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+		err |= workers[i].err;
+	}
+	gettimeofday(&end, NULL);
+	free(workers);
+	if (err) {
+		perror(path);
+		exit(1);
+	}
+	elapsed = (end.tv_sec - start.tv_sec) +
+		(end.tv_usec - start.tv_usec) / 1e6;
+	return ops / elapsed;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-m stat|open|read] [-t MAX_THREADS] "
+			"[-s SECONDS] path\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	int opt_char, nr, max_threads, secs;
+	double rate, base = 0;
+
+	max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (max_threads < 1)
+		max_threads = 1;
+	secs = 3;
+
+	while ((opt_char = getopt(argc, argv, "m:t:s:h")) != -1) {
+		switch (opt_char) {
+		case 'm':
+			if (!strcmp(optarg, "stat"))
+				mode = MODE_STAT;
+			else if (!strcmp(optarg, "open"))
+				mode = MODE_OPEN;
+			else if (!strcmp(optarg, "read"))
+				mode = MODE_READ;
+			else {
+				usage(argv[0]);
+				return -1;
+			}
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			secs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if (argc != optind + 1 || max_threads < 1 || secs < 1) {
+		usage(argv[0]);
+		return -1;
+	}
+	path = argv[optind];
+
+	printf("%8s %14s %14s %8s\n", "threads", "ops/s", "ops/s/thread",
+	       "scaling");
+	for (nr = 1; ; nr *= 2) {
+		if (nr > max_threads)
+			nr = max_threads;
+		rate = bench(nr, secs);
+		if (nr == 1)
+			base = rate;
+		printf("%8d %14.0f %14.0f %8.2f\n", nr, rate, rate / nr,
+		       rate / base);
+		fflush(stdout);
+		if (nr == max_threads)
+			break;
+	}
+	return 0;
+}
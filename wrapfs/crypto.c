@@ -0,0 +1,1214 @@
+/*
+ * Copyright (c) 1998-2011 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2011 Stony Brook University
+ * Copyright (c) 2003-2011 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/scatterlist.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/hash.h>
+#include <linux/cred.h>
+
+#include "wrapfs.h"
+
+#ifdef WRAPFS_CRYPTO
+/* largest IV of any cipher we may be asked to use */
+#define WRAPFS_MAX_IV_SIZE	16
+/* the AES counter advances once per this many bytes */
+#define WRAPFS_CTR_BLOCK_SIZE	16
+/* pages pushed through the cipher by the mount-time benchmark */
+#define WRAPFS_BENCH_PAGES	256
+/* names are padded to whole blocks of this, whatever cipher= says */
+#define WRAPFS_NAME_ALGO	"cbc(aes)"
+#define WRAPFS_NAME_BLOCK	16
+/* digest of long names, and stack room for its state */
+#define WRAPFS_NAME_HASH_ALGO	"sha256"
+#define WRAPFS_NAME_HASH_CTX	256
+
+/* the original layout: every page restarts the counter at zero */
+static void wrapfs_iv_ctr(u8 *iv, unsigned int ivsize, u64 ino,
+			  pgoff_t index, unsigned int block)
+{
+	memset(iv, 0, ivsize);
+	*(__be32 *)(iv + ivsize - sizeof(__be32)) = cpu_to_be32(block);
+}
+
+/*
+ * Nonce from the inode, counter from the position in the file: no two
+ * blocks of the mount share keystream, which ctr's layout cannot say.
+ */
+static void wrapfs_iv_ctr_tweak(u8 *iv, unsigned int ivsize, u64 ino,
+				pgoff_t index, unsigned int block)
+{
+	__be64 *iv64 = (__be64 *)iv;
+
+	iv64[0] = cpu_to_be64(ino);
+	iv64[1] = cpu_to_be64(((u64)index << (PAGE_SHIFT - 4)) + block);
+}
+
+/*
+ * salsa20 has a 64-bit nonce and no way to start mid-stream.  Only 32
+ * bits each of inode number and page index fit, so the mode is marked
+ * iv32: interpose refuses regular files with larger inode numbers, and
+ * read_super caps files at 2^32 pages.
+ */
+static void wrapfs_iv_salsa20(u8 *iv, unsigned int ivsize, u64 ino,
+			      pgoff_t index, unsigned int block)
+{
+	__be32 *iv32 = (__be32 *)iv;
+
+	iv32[0] = cpu_to_be32((u32)ino);
+	iv32[1] = cpu_to_be32((u32)index);
+}
+
+/*
+ * The cipher= choices; the first one is the default and the on-disk
+ * format of files written before there was a choice.  Every mode must
+ * be a stream cipher: the lower file is exactly as long as ours, so
+ * there is no room for padding the last block.
+ */
+static const struct wrapfs_cipher_mode wrapfs_cipher_modes[] = {
+	{ "ctr", "ctr(aes)", WRAPFS_CTR_BLOCK_SIZE, wrapfs_iv_ctr, false,
+	  false },
+	{ "ctr-tweak", "ctr(aes)", WRAPFS_CTR_BLOCK_SIZE,
+	  wrapfs_iv_ctr_tweak, true, false },
+	{ "salsa20", "salsa20", 0, wrapfs_iv_salsa20, true, true },
+};
+
+/* cipher= value to its index in wrapfs_cipher_modes, or -EINVAL */
+int wrapfs_cipher_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(wrapfs_cipher_modes); i++)
+		if (!strcmp(name, wrapfs_cipher_modes[i].name))
+			return i;
+	printk(KERN_ERR "wrapfs: unknown cipher '%s'\n", name);
+	return -EINVAL;
+}
+
+/*
+ * Push WRAPFS_BENCH_PAGES pages through @mode with a throwaway key and
+ * log the rate, so the implementation the crypto API picked for this
+ * mount (and whether it is the fast one) shows up in the kernel log.
+ * Also makes a mount with an unavailable algorithm fail right away.
+ */
+static int wrapfs_cipher_bench(const struct wrapfs_cipher_mode *mode)
+{
+	struct crypto_blkcipher *tfm;
+	struct blkcipher_desc desc;
+	struct scatterlist sg;
+	struct page *page;
+	u8 key[32], iv[WRAPFS_MAX_IV_SIZE];
+	ktime_t start;
+	s64 ns;
+	int i, err;
+
+	tfm = crypto_alloc_blkcipher(mode->algo, 0, CRYPTO_ALG_ASYNC);
+	if (IS_ERR(tfm)) {
+		printk(KERN_ERR "wrapfs: cipher %s: cannot load %s: %ld\n",
+		       mode->name, mode->algo, PTR_ERR(tfm));
+		return PTR_ERR(tfm);
+	}
+	page = alloc_page(GFP_KERNEL);
+	if (!page) {
+		err = -ENOMEM;
+		goto out_tfm;
+	}
+	get_random_bytes(key, sizeof(key));
+	err = crypto_blkcipher_setkey(tfm, key, sizeof(key));
+	if (err)
+		goto out_page;
+
+	desc.tfm = tfm;
+	desc.info = iv;
+	desc.flags = 0;
+	sg_init_table(&sg, 1);
+	sg_set_page(&sg, page, PAGE_SIZE, 0);
+	start = ktime_get();
+	for (i = 0; i < WRAPFS_BENCH_PAGES && !err; i++) {
+		mode->make_iv(iv, crypto_blkcipher_ivsize(tfm), 0, i, 0);
+		err = crypto_blkcipher_encrypt_iv(&desc, &sg, &sg, PAGE_SIZE);
+	}
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	if (!err)
+		printk(KERN_INFO "wrapfs: cipher %s (%s): %llu MB/s\n",
+		       mode->name,
+		       crypto_tfm_alg_driver_name(crypto_blkcipher_tfm(tfm)),
+		       div64_u64((u64)WRAPFS_BENCH_PAGES * PAGE_SIZE *
+				 NSEC_PER_SEC, max_t(s64, ns, 1) << 20));
+out_page:
+	__free_page(page);
+out_tfm:
+	crypto_free_blkcipher(tfm);
+	memset(key, 0, sizeof(key));
+	return err;
+}
+
+static void wrapfs_free_tfms(struct wrapfs_sb_info *sbi,
+			     struct crypto_blkcipher * __percpu *tfms)
+{
+	int cpu;
+
+	if (!tfms)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct crypto_blkcipher *tfm = *per_cpu_ptr(tfms, cpu);
+
+		if (!tfm)
+			continue;
+		crypto_free_blkcipher(tfm);
+		atomic_long_inc(&sbi->stats.tfm_frees);
+	}
+	free_percpu(tfms);
+}
+
+static void wrapfs_free_atfm(struct wrapfs_sb_info *sbi,
+			     struct crypto_ablkcipher *atfm)
+{
+	if (!atfm)
+		return;
+	crypto_free_ablkcipher(atfm);
+	atomic_long_inc(&sbi->stats.tfm_frees);
+}
+
+/* called from read_super, before anyone can see the superblock */
+int wrapfs_crypt_init(struct super_block *sb,
+		      const struct wrapfs_mount_opts *opts)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+
+	int err;
+
+	mutex_init(&sbi->crypt.key_mutex);
+	sbi->crypt.mode = &wrapfs_cipher_modes[opts->cipher];
+	sbi->crypt.encnames = opts->encnames;
+	sbi->crypt.async = opts->async;
+	RCU_INIT_POINTER(sbi->crypt.key, NULL);
+	err = wrapfs_cipher_bench(sbi->crypt.mode);
+	if (err)
+		return err;
+
+	/* a whole batch must fit in the reserve for writeback to progress */
+	sbi->bounce_reserve = opts->bounce_pages;
+	if (sbi->bounce_reserve <= 0)
+		sbi->bounce_reserve = WRAPFS_DEFAULT_BOUNCE_PAGES;
+	if (sbi->bounce_reserve < WRAPFS_CRYPT_BATCH)
+		sbi->bounce_reserve = WRAPFS_CRYPT_BATCH;
+	sbi->bounce_pool = mempool_create_page_pool(sbi->bounce_reserve, 0);
+	if (!sbi->bounce_pool) {
+		printk(KERN_ERR "wrapfs: cannot reserve %d bounce pages\n",
+		       sbi->bounce_reserve);
+		return -ENOMEM;
+	}
+	sbi->crypt.mounter_cred = get_current_cred();
+	return 0;
+}
+
+/*
+ * Called from put_super: no I/O can be in flight any more, but the last
+ * key may still be on its way to being freed, and it points back at us.
+ */
+void wrapfs_crypt_destroy(struct super_block *sb)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+
+	wrapfs_crypt_clearkey(sb);
+	rcu_barrier();
+	flush_scheduled_work();
+	if (sbi->bounce_pool)
+		mempool_destroy(sbi->bounce_pool);
+	sbi->bounce_pool = NULL;
+	if (sbi->crypt.mounter_cred)
+		put_cred(sbi->crypt.mounter_cred);
+	sbi->crypt.mounter_cred = NULL;
+}
+
+static void wrapfs_bounce_account(struct wrapfs_sb_info *sbi, long nr)
+{
+	long in_use, hw;
+
+	in_use = atomic_long_add_return(nr, &sbi->stats.bounce_in_use);
+	hw = atomic_long_read(&sbi->stats.bounce_high_water);
+	while (in_use > hw) {
+		long old = atomic_long_cmpxchg(&sbi->stats.bounce_high_water,
+					       hw, in_use);
+		if (old == hw)
+			break;
+		hw = old;
+	}
+}
+
+/*
+ * wrapfs_get_bounce_pages
+ * @sb: the wrapfs superblock
+ * @pages: array receiving the bounce pages
+ * @nr_pages: number of pages wanted
+ *
+ * Take up to @nr_pages bounce pages from the per-mount pool.  Only the
+ * first page may sleep, and only while we hold none: a caller never
+ * waits on the reserve with pages of it in hand, so all writers together
+ * cannot drain the reserve and wait on each other.  Later pages are
+ * taken without waiting, and the caller gets fewer than it asked for if
+ * the reserve runs dry.
+ *
+ * Returns the number of pages taken, at least one.
+ */
+unsigned int wrapfs_get_bounce_pages(struct super_block *sb,
+				     struct page **pages,
+				     unsigned int nr_pages)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	unsigned int i;
+
+	pages[0] = mempool_alloc(sbi->bounce_pool, GFP_NOWAIT);
+	if (!pages[0]) {
+		atomic_long_inc(&sbi->stats.bounce_waits);
+		pages[0] = mempool_alloc(sbi->bounce_pool, GFP_NOFS);
+	}
+	for (i = 1; i < nr_pages; i++) {
+		pages[i] = mempool_alloc(sbi->bounce_pool, GFP_NOWAIT);
+		if (!pages[i])
+			break;
+	}
+	wrapfs_bounce_account(sbi, i);
+	return i;
+}
+
+void wrapfs_put_bounce_pages(struct super_block *sb, struct page **pages,
+			     unsigned int nr_pages)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	unsigned int i;
+
+	for (i = 0; i < nr_pages; i++)
+		mempool_free(pages[i], sbi->bounce_pool);
+	atomic_long_sub(nr_pages, &sbi->stats.bounce_in_use);
+}
+
+static void wrapfs_free_names(struct wrapfs_sb_info *sbi,
+			      struct wrapfs_key *key)
+{
+	struct wrapfs_name_ent *ent, *next;
+
+	if (key->name_tfm) {
+		crypto_free_blkcipher(key->name_tfm);
+		atomic_long_inc(&sbi->stats.tfm_frees);
+	}
+	if (key->name_hash) {
+		crypto_free_shash(key->name_hash);
+		atomic_long_inc(&sbi->stats.tfm_frees);
+	}
+	if (!key->names)
+		return;
+	list_for_each_entry_safe(ent, next, &key->names->lru, lru)
+		kfree(ent);
+	kfree(key->names);
+}
+
+/* the transform and the empty cache for encnames, keyed with @key */
+static int wrapfs_alloc_names(struct wrapfs_sb_info *sbi,
+			      struct wrapfs_key *key, unsigned int key_len)
+{
+	int err;
+
+	key->names = kzalloc(sizeof(*key->names), GFP_KERNEL);
+	if (!key->names)
+		return -ENOMEM;
+	spin_lock_init(&key->names->lock);
+	INIT_LIST_HEAD(&key->names->lru);
+
+	key->name_tfm = crypto_alloc_blkcipher(WRAPFS_NAME_ALGO, 0,
+					       CRYPTO_ALG_ASYNC);
+	if (IS_ERR(key->name_tfm)) {
+		err = PTR_ERR(key->name_tfm);
+		key->name_tfm = NULL;
+		printk(KERN_ERR "wrapfs: failed to load transform for %s: "
+		       "%d\n", WRAPFS_NAME_ALGO, err);
+		return err;
+	}
+	atomic_long_inc(&sbi->stats.tfm_allocs);
+
+	key->name_hash = crypto_alloc_shash(WRAPFS_NAME_HASH_ALGO, 0, 0);
+	if (IS_ERR(key->name_hash)) {
+		err = PTR_ERR(key->name_hash);
+		key->name_hash = NULL;
+		printk(KERN_ERR "wrapfs: failed to load transform for %s: "
+		       "%d\n", WRAPFS_NAME_HASH_ALGO, err);
+		return err;
+	}
+	atomic_long_inc(&sbi->stats.tfm_allocs);
+	if (crypto_shash_descsize(key->name_hash) > WRAPFS_NAME_HASH_CTX ||
+	    crypto_shash_digestsize(key->name_hash) !=
+	    WRAPFS_LONG_NAME_DIGEST) {
+		printk(KERN_ERR "wrapfs: unusable %s implementation %s\n",
+		       WRAPFS_NAME_HASH_ALGO,
+		       crypto_tfm_alg_driver_name(
+			       crypto_shash_tfm(key->name_hash)));
+		return -EINVAL;
+	}
+	return crypto_blkcipher_setkey(key->name_tfm, key->raw, key_len);
+}
+
+static void wrapfs_key_free_work(struct work_struct *work)
+{
+	struct wrapfs_key *key = container_of(work, struct wrapfs_key,
+					      free_work);
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(key->sb);
+
+	wrapfs_free_tfms(sbi, key->tfms);
+	wrapfs_free_atfm(sbi, key->atfm);
+	wrapfs_free_names(sbi, key);
+	memset(key->raw, 0, sizeof(key->raw));
+	kfree(key);
+}
+
+/* the last reader is gone; freeing transforms may sleep */
+static void wrapfs_key_free_rcu(struct rcu_head *rcu)
+{
+	struct wrapfs_key *key = container_of(rcu, struct wrapfs_key, rcu);
+
+	INIT_WORK(&key->free_work, wrapfs_key_free_work);
+	schedule_work(&key->free_work);
+}
+
+static void wrapfs_put_key(struct wrapfs_key *key)
+{
+	if (atomic_dec_and_test(&key->count))
+		call_rcu(&key->rcu, wrapfs_key_free_rcu);
+}
+
+/* install @key (or none) and drop the mount's reference to the old one */
+static void wrapfs_swap_key(struct super_block *sb, struct wrapfs_key *key)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct wrapfs_key *old;
+
+	mutex_lock(&sbi->crypt.key_mutex);
+	old = rcu_dereference_protected(sbi->crypt.key,
+				lockdep_is_held(&sbi->crypt.key_mutex));
+	rcu_assign_pointer(sbi->crypt.key, key);
+	mutex_unlock(&sbi->crypt.key_mutex);
+	if (old)
+		wrapfs_put_key(old);
+}
+
+/*
+ * Build a key object: allocate and key one transform per possible cpu
+ * (and the async one if asked for), then swap it in.  This is the only
+ * place transforms get allocated; the page path only ever borrows the
+ * one belonging to the cpu it runs on.  I/O already running finishes
+ * on the old key.
+ *
+ * Returns 0 on success and appropriate negative error on failure.
+ */
+int wrapfs_crypt_setkey(struct super_block *sb, const u8 *raw,
+			unsigned int key_len)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	const char *algo = sbi->crypt.mode->algo;
+	struct wrapfs_key *key;
+	int cpu, err = 0;
+#ifdef EXTRA_CREDIT
+	if (debug_opt & ALL_DOPS)
+		UDBG;
+#endif
+	if (key_len > WRAPFS_KEY_SIZE) {
+		err = -EINVAL;
+		goto out;
+	}
+	key = kzalloc(sizeof(*key), GFP_KERNEL);
+	if (!key) {
+		err = -ENOMEM;
+		goto out;
+	}
+	atomic_set(&key->count, 1);
+	key->sb = sb;
+	memcpy(key->raw, raw, key_len);
+	key->tfms = alloc_percpu(struct crypto_blkcipher *);
+	if (!key->tfms) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+	for_each_possible_cpu(cpu) {
+		struct crypto_blkcipher *tfm;
+
+		tfm = crypto_alloc_blkcipher(algo, 0, CRYPTO_ALG_ASYNC);
+		if (IS_ERR(tfm)) {
+			err = PTR_ERR(tfm);
+			printk(KERN_ERR "wrapfs: failed to load transform "
+			       "for %s: %d\n", algo, err);
+			goto out_free;
+		}
+		*per_cpu_ptr(key->tfms, cpu) = tfm;
+		atomic_long_inc(&sbi->stats.tfm_allocs);
+
+		err = crypto_blkcipher_setkey(tfm, key->raw, key_len);
+		if (err) {
+			printk(KERN_ERR "wrapfs: setkey() failed flags=%x\n",
+			       crypto_blkcipher_get_flags(tfm));
+			goto out_free;
+		}
+	}
+
+	/*
+	 * The async transform may be backed by a multi-buffer or offload
+	 * driver (aesni registers ctr(aes) as async only).  Without one we
+	 * quietly stay on the synchronous per-cpu transforms.
+	 */
+	if (sbi->crypt.async) {
+		key->atfm = crypto_alloc_ablkcipher(algo, 0, 0);
+		if (IS_ERR(key->atfm)) {
+			printk(KERN_WARNING "wrapfs: no async transform for "
+			       "%s (%ld), using synchronous crypto\n",
+			       algo, PTR_ERR(key->atfm));
+			key->atfm = NULL;
+		} else {
+			atomic_long_inc(&sbi->stats.tfm_allocs);
+			err = crypto_ablkcipher_setkey(key->atfm, key->raw,
+						       key_len);
+			if (err) {
+				printk(KERN_ERR "wrapfs: async setkey() failed "
+				       "flags=%x\n",
+				       crypto_ablkcipher_get_flags(key->atfm));
+				goto out_free;
+			}
+		}
+	}
+
+	if (sbi->crypt.encnames) {
+		err = wrapfs_alloc_names(sbi, key, key_len);
+		if (err)
+			goto out_free;
+	}
+
+	wrapfs_swap_key(sb, key);
+	atomic_long_inc(&sbi->stats.setkeys);
+	goto out;
+
+out_free:
+	/* never published: nobody else can be looking at it */
+	wrapfs_free_tfms(sbi, key->tfms);
+	wrapfs_free_atfm(sbi, key->atfm);
+	wrapfs_free_names(sbi, key);
+	memset(key->raw, 0, sizeof(key->raw));
+	kfree(key);
+out:
+#ifdef EXTRA_CREDIT
+	if (debug_opt & ALL_DOPS)
+		DBGRET(err);
+#endif
+	return err;
+}
+
+/* drop the key; the page path fails with -EPERM afterwards */
+void wrapfs_crypt_clearkey(struct super_block *sb)
+{
+	wrapfs_swap_key(sb, NULL);
+}
+
+/*
+ * Filename encryption (encnames).  A name is padded with NULs to whole
+ * cipher blocks, encrypted with WRAPFS_NAME_ALGO under the mount key and
+ * a zero IV, and base64 encoded with '+' and '_' for the last two
+ * digits, so that it is a valid lower name.  The same name always gives
+ * the same lower name, in any directory: lookup needs nothing but the
+ * name, and a copy of the lower tree keeps its names.  The price is
+ * that two names sharing their first 16 bytes share the first part of
+ * their lower names.
+ */
+static const char wrapfs_b64[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+_";
+
+static unsigned int wrapfs_b64_encode(const u8 *src, unsigned int len,
+				      char *dst)
+{
+	unsigned int i, n = 0, bits = 0;
+	u32 acc = 0;
+
+	for (i = 0; i < len; i++) {
+		acc = (acc << 8) | src[i];
+		bits += 8;
+		while (bits >= 6) {
+			bits -= 6;
+			dst[n++] = wrapfs_b64[(acc >> bits) & 0x3f];
+		}
+	}
+	if (bits)
+		dst[n++] = wrapfs_b64[(acc << (6 - bits)) & 0x3f];
+	return n;
+}
+
+/* -EINVAL unless @src is exactly what wrapfs_b64_encode() gives */
+static int wrapfs_b64_decode(const char *src, unsigned int len, u8 *dst)
+{
+	unsigned int i, n = 0, bits = 0;
+	u32 acc = 0;
+
+	for (i = 0; i < len; i++) {
+		const char *p = src[i] ? strchr(wrapfs_b64, src[i]) : NULL;
+
+		if (!p)
+			return -EINVAL;
+		acc = (acc << 6) | (p - wrapfs_b64);
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			dst[n++] = acc >> bits;
+		}
+	}
+	if (bits >= 6 || acc & ((1 << bits) - 1))
+		return -EINVAL;
+	return n;
+}
+
+static int wrapfs_name_crypt(struct crypto_blkcipher *tfm, u8 *buf,
+			     unsigned int len, int encrypt)
+{
+	struct blkcipher_desc desc;
+	struct scatterlist sg;
+	u8 iv[WRAPFS_MAX_IV_SIZE];
+
+	memset(iv, 0, sizeof(iv));
+	desc.tfm = tfm;
+	desc.info = iv;
+	desc.flags = 0;
+	sg_init_one(&sg, buf, len);
+	if (encrypt)
+		return crypto_blkcipher_encrypt_iv(&desc, &sg, &sg, len);
+	return crypto_blkcipher_decrypt_iv(&desc, &sg, &sg, len);
+}
+
+/* pad @name into @buf and encrypt it; returns the padded length */
+static int wrapfs_name_encrypt(struct wrapfs_key *key, const char *name,
+			       unsigned int len, u8 *buf)
+{
+	unsigned int padded;
+	int err;
+
+	padded = max_t(unsigned int, round_up(len, WRAPFS_NAME_BLOCK),
+		       WRAPFS_NAME_BLOCK);
+	memcpy(buf, name, len);
+	memset(buf + len, 0, padded - len);
+	err = wrapfs_name_crypt(key->name_tfm, buf, padded, 1);
+	return err ? err : padded;
+}
+
+/* decrypt @n bytes of @buf in place into @name, if it is a name of ours */
+static int wrapfs_name_decrypt(struct wrapfs_key *key, u8 *buf,
+			       unsigned int n, char *name)
+{
+	int ret;
+
+	ret = wrapfs_name_crypt(key->name_tfm, buf, n, 0);
+	if (ret)
+		return ret;
+	ret = strnlen((char *)buf, n);
+	/* NUL padding only, and never a name the VFS would not give us */
+	if (!ret || ret > NAME_MAX || memchr_inv(buf + ret, 0, n - ret) ||
+	    memchr(buf, '/', ret) ||
+	    (buf[0] == '.' && (ret == 1 || (ret == 2 && buf[1] == '.'))))
+		return -EINVAL;
+	memcpy(name, buf, ret);
+	return ret;
+}
+
+static int wrapfs_name_digest(struct wrapfs_key *key, const u8 *buf,
+			      unsigned int len, u8 *digest)
+{
+	struct {
+		struct shash_desc shash;
+		char ctx[WRAPFS_NAME_HASH_CTX];
+	} desc;
+
+	desc.shash.tfm = key->name_hash;
+	desc.shash.flags = 0;
+	return crypto_shash_digest(&desc.shash, buf, len, digest);
+}
+
+/* the lower name of a long name whose ciphertext is @buf */
+static int wrapfs_long_name_encode(struct wrapfs_key *key, const u8 *buf,
+				   unsigned int len, char *lower_name)
+{
+	u8 digest[WRAPFS_LONG_NAME_DIGEST];
+	int err;
+
+	err = wrapfs_name_digest(key, buf, len, digest);
+	if (err)
+		return err;
+	lower_name[0] = WRAPFS_LONG_NAME_PREFIX;
+	return 1 + wrapfs_b64_encode(digest, sizeof(digest), lower_name + 1);
+}
+
+/* find a pair by either of its names, and make it the most recent */
+static struct wrapfs_name_ent *wrapfs_name_find(struct wrapfs_name_cache *c,
+						bool lower, const char *name,
+						unsigned int len)
+{
+	unsigned int h = hash_long(full_name_hash(name, len),
+				   WRAPFS_NAME_HASH_BITS);
+	struct wrapfs_name_ent *ent;
+	struct hlist_node *pos;
+
+	if (lower) {
+		hlist_for_each_entry(ent, pos, &c->lower[h], lower_node)
+			if (ent->lower_len == len &&
+			    !memcmp(ent->lower, name, len))
+				goto found;
+	} else {
+		hlist_for_each_entry(ent, pos, &c->plain[h], plain_node)
+			if (ent->plain_len == len &&
+			    !memcmp(ent->name, name, len))
+				goto found;
+	}
+	return NULL;
+found:
+	list_move(&ent->lru, &c->lru);
+	return ent;
+}
+
+/* remember a pair; a failed allocation only costs a later cipher call */
+static void wrapfs_name_insert(struct wrapfs_name_cache *c,
+			       const char *name, unsigned int len,
+			       const char *lower, unsigned int lower_len)
+{
+	struct wrapfs_name_ent *ent;
+
+	ent = kmalloc(sizeof(*ent) + len + lower_len, GFP_ATOMIC);
+	if (!ent)
+		return;
+	ent->plain_len = len;
+	ent->lower_len = lower_len;
+	ent->lower = ent->name + len;
+	memcpy(ent->name, name, len);
+	memcpy(ent->lower, lower, lower_len);
+
+	spin_lock(&c->lock);
+	if (wrapfs_name_find(c, false, name, len)) {
+		spin_unlock(&c->lock);
+		kfree(ent);
+		return;
+	}
+	hlist_add_head(&ent->plain_node,
+		       &c->plain[hash_long(full_name_hash(name, len),
+					   WRAPFS_NAME_HASH_BITS)]);
+	hlist_add_head(&ent->lower_node,
+		       &c->lower[hash_long(full_name_hash(lower, lower_len),
+					   WRAPFS_NAME_HASH_BITS)]);
+	list_add(&ent->lru, &c->lru);
+	if (++c->nr > WRAPFS_NAME_CACHE_SIZE) {
+		struct wrapfs_name_ent *old;
+
+		old = list_entry(c->lru.prev, struct wrapfs_name_ent, lru);
+		hlist_del(&old->plain_node);
+		hlist_del(&old->lower_node);
+		list_del(&old->lru);
+		c->nr--;
+		kfree(old);
+	}
+	spin_unlock(&c->lock);
+}
+
+/*
+ * wrapfs_encrypt_name
+ * @sb: the wrapfs superblock
+ * @name: the name, @len bytes long
+ * @lower_name: receives the NUL terminated lower name; NAME_MAX + 1 bytes
+ *
+ * Names longer than WRAPFS_NAME_PLAIN_MAX get the fixed-length lower
+ * name of wrapfs_long_name_encode(): still a function of the name alone,
+ * so a lookup never needs the directory's index.
+ *
+ * Returns the length of the lower name, or -ENOKEY without a key.
+ */
+int wrapfs_encrypt_name(struct super_block *sb, const char *name,
+			unsigned int len, char *lower_name)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct wrapfs_name_ent *ent;
+	struct wrapfs_key *key;
+	u8 buf[WRAPFS_NAME_CRYPT_MAX];
+	int ret;
+
+	if (len > NAME_MAX)
+		return -ENAMETOOLONG;
+	/* nothing below sleeps: the key can't go away under us */
+	rcu_read_lock();
+	key = rcu_dereference(sbi->crypt.key);
+	if (!key) {
+		ret = -ENOKEY;
+		goto out;
+	}
+	spin_lock(&key->names->lock);
+	ent = wrapfs_name_find(key->names, false, name, len);
+	if (ent) {
+		memcpy(lower_name, ent->lower, ent->lower_len);
+		ret = ent->lower_len;
+	}
+	spin_unlock(&key->names->lock);
+	if (ent) {
+		atomic_long_inc(&sbi->stats.name_hits);
+		goto out_term;
+	}
+
+	atomic_long_inc(&sbi->stats.name_misses);
+	ret = wrapfs_name_encrypt(key, name, len, buf);
+	if (ret < 0)
+		goto out;
+	if (ret > WRAPFS_NAME_PLAIN_MAX)
+		ret = wrapfs_long_name_encode(key, buf, ret, lower_name);
+	else
+		ret = wrapfs_b64_encode(buf, ret, lower_name);
+	if (ret < 0)
+		goto out;
+	wrapfs_name_insert(key->names, name, len, lower_name, ret);
+out_term:
+	lower_name[ret] = '\0';
+out:
+	rcu_read_unlock();
+	return ret;
+}
+
+/*
+ * wrapfs_encrypt_long_name
+ * @sb: the wrapfs superblock
+ * @name: the name, @len bytes long
+ * @rec: receives the index record of the name; zeroed by the caller
+ *
+ * Returns the length of the encrypted name in @rec, 0 if @name is short
+ * enough to need no record, or -ENOKEY without a key.
+ */
+int wrapfs_encrypt_long_name(struct super_block *sb, const char *name,
+			     unsigned int len, struct wrapfs_long_name *rec)
+{
+	struct wrapfs_key *key;
+	int ret = -ENOKEY;
+
+	if (len <= WRAPFS_NAME_PLAIN_MAX)
+		return 0;
+	if (len > NAME_MAX)
+		return -ENAMETOOLONG;
+	rcu_read_lock();
+	key = rcu_dereference(WRAPFS_SB(sb)->crypt.key);
+	if (!key)
+		goto out;
+	ret = wrapfs_name_encrypt(key, name, len, rec->name);
+	if (ret < 0)
+		goto out;
+	rec->len = cpu_to_le16(ret);
+	ret = wrapfs_name_digest(key, rec->name, ret, rec->digest);
+	if (!ret)
+		ret = le16_to_cpu(rec->len);
+out:
+	rcu_read_unlock();
+	return ret;
+}
+
+/*
+ * wrapfs_decrypt_name() with the key in hand, under rcu_read_lock().
+ * A long name is only known from the name cache or from @names, the
+ * index of the directory it is in.
+ */
+static int __wrapfs_decrypt_name(struct wrapfs_sb_info *sbi,
+				 struct wrapfs_key *key,
+				 const char *lower_name, unsigned int len,
+				 struct wrapfs_long_names *names, char *name)
+{
+	const struct wrapfs_long_name *rec;
+	struct wrapfs_name_ent *ent;
+	u8 buf[WRAPFS_NAME_CRYPT_MAX];
+	u8 digest[WRAPFS_LONG_NAME_DIGEST];
+	int n, ret;
+
+	if (len > NAME_MAX)
+		return -EINVAL;
+	spin_lock(&key->names->lock);
+	ent = wrapfs_name_find(key->names, true, lower_name, len);
+	if (ent) {
+		memcpy(name, ent->name, ent->plain_len);
+		ret = ent->plain_len;
+	}
+	spin_unlock(&key->names->lock);
+	if (ent) {
+		atomic_long_inc(&sbi->stats.name_hits);
+		goto out_term;
+	}
+
+	atomic_long_inc(&sbi->stats.name_misses);
+	ret = -EINVAL;
+	if (lower_name[0] != WRAPFS_LONG_NAME_PREFIX) {
+		n = wrapfs_b64_decode(lower_name, len, buf);
+		if (n <= 0 || n % WRAPFS_NAME_BLOCK ||
+		    n > WRAPFS_NAME_PLAIN_MAX)
+			goto out;
+	} else {
+		if (!names || len != WRAPFS_LONG_NAME_LEN ||
+		    wrapfs_b64_decode(lower_name + 1, len - 1, digest) !=
+		    sizeof(digest))
+			goto out;
+		rec = wrapfs_long_names_find(names, digest);
+		if (!rec)
+			goto out;
+		n = le16_to_cpu(rec->len);
+		memcpy(buf, rec->name, n);
+		/* the index is only a hint: the digest must match */
+		if (wrapfs_name_digest(key, buf, n, digest) ||
+		    memcmp(digest, rec->digest, sizeof(digest)))
+			goto out;
+	}
+	ret = wrapfs_name_decrypt(key, buf, n, name);
+	if (ret < 0)
+		goto out;
+	wrapfs_name_insert(key->names, name, ret, lower_name, len);
+out_term:
+	name[ret] = '\0';
+out:
+	return ret;
+}
+
+/*
+ * wrapfs_decrypt_name
+ * @sb: the wrapfs superblock
+ * @lower_name: the lower name, @len bytes long
+ * @name: receives the NUL terminated name; NAME_MAX + 1 bytes
+ *
+ * Returns the length of the name, -ENOKEY without a key or -EINVAL if
+ * @lower_name is not one wrapfs_encrypt_name() could have made (such
+ * as lost+found).
+ */
+int wrapfs_decrypt_name(struct super_block *sb, const char *lower_name,
+			unsigned int len, char *name)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct wrapfs_key *key;
+	int ret = -ENOKEY;
+
+	rcu_read_lock();
+	key = rcu_dereference(sbi->crypt.key);
+	if (key)
+		ret = __wrapfs_decrypt_name(sbi, key, lower_name, len, NULL,
+					    name);
+	rcu_read_unlock();
+	return ret;
+}
+
+/*
+ * wrapfs_decrypt_dirents
+ * @sb: the wrapfs superblock
+ * @chunk: lower directory entries gathered by readdir
+ * @names: the directory's long name index, or NULL
+ *
+ * Decrypt the names of a chunk of directory entries in place, with the
+ * key looked up once for the lot.  "." and ".." are left alone, and an
+ * entry whose lower name is not ours gets a zero namlen.  Long names
+ * come from @names; their entries were given room for NAME_MAX bytes.
+ *
+ * Returns 0, or -ENOKEY without a key.
+ */
+int wrapfs_decrypt_dirents(struct super_block *sb,
+			   struct wrapfs_dir_chunk *chunk,
+			   struct wrapfs_long_names *names)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(sb);
+	struct wrapfs_dirent *de;
+	struct wrapfs_key *key;
+	char name[NAME_MAX + 1];
+	size_t off;
+	int ret = 0;
+
+	rcu_read_lock();
+	key = rcu_dereference(sbi->crypt.key);
+	if (!key) {
+		ret = -ENOKEY;
+		goto out;
+	}
+	for (off = 0; off < chunk->used; off += de->reclen) {
+		int len;
+
+		de = (struct wrapfs_dirent *)(chunk->data + off);
+		if (de->name[0] == '.' && (de->namlen == 1 ||
+		    (de->namlen == 2 && de->name[1] == '.')))
+			continue;
+		len = __wrapfs_decrypt_name(sbi, key, de->name, de->namlen,
+					    names, name);
+		if (len < 0)
+			len = 0;
+		memcpy(de->name, name, len);
+		de->namlen = len;
+	}
+out:
+	rcu_read_unlock();
+	return ret;
+}
+
+/*
+ * wrapfs_crypt_sg
+ * @inode: the wrapfs inode the pages belong to; its superblock owns the
+ *         keyed transforms
+ * @index: file page index of the first entry
+ * @dst: scatterlist receiving the result, one page per entry
+ * @src: scatterlist with the input, one page per entry; may be
+ *       the same list as @dst to work in place
+ * @nr_pages: number of entries (pages) in the run
+ * @encrypt: 1 to encrypt, 0 to decrypt
+ *
+ * Batched entry point for a run of contiguous pages.  The transform,
+ * the key lock and the cpu are taken once for the whole run instead of
+ * once per page.  The IV is derived afresh for each page from the
+ * inode, the page index and the offset in the page, as the mount's
+ * cipher mode says; a run therefore produces exactly the ciphertext the
+ * same pages would get one by one.  An entry need not cover its whole
+ * page: it is processed from its offset, which must be a multiple of
+ * the mode's counter block, with the counter advanced to match.
+ *
+ * Returns 0 on success and appropriate negative error on failure.
+ */
+int wrapfs_crypt_sg(struct inode *inode, pgoff_t index,
+		    struct scatterlist *dst, struct scatterlist *src,
+		    unsigned int nr_pages, int encrypt)
+{
+	int ret = 0;
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+	const struct wrapfs_cipher_mode *mode = sbi->crypt.mode;
+	struct wrapfs_key *key;
+	struct blkcipher_desc desc;
+	unsigned int i, ivsize;
+	u8 iv[WRAPFS_MAX_IV_SIZE];
+#ifdef EXTRA_CREDIT
+	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
+		UDBG;
+#endif
+	/* nothing below sleeps: the key can't go away under us */
+	rcu_read_lock();
+	key = rcu_dereference(sbi->crypt.key);
+	if (!key) {
+		ret = -EPERM;
+		goto out_unlock;
+	}
+	desc.tfm = *get_cpu_ptr(key->tfms);
+	desc.info = iv;
+	desc.flags = 0;
+	ivsize = crypto_blkcipher_ivsize(desc.tfm);
+
+	for (i = 0; i < nr_pages; i++) {
+		BUG_ON(src->offset &&
+		       (!mode->ctr_block || src->offset % mode->ctr_block));
+		mode->make_iv(iv, ivsize, inode->i_ino, index + i,
+			      src->offset ? src->offset / mode->ctr_block : 0);
+		if (encrypt)
+			ret = crypto_blkcipher_encrypt_iv(&desc, dst, src,
+							  src->length);
+		else
+			ret = crypto_blkcipher_decrypt_iv(&desc, dst, src,
+							  src->length);
+		if (ret)
+			break;
+		dst = sg_next(dst);
+		src = sg_next(src);
+	}
+	put_cpu_ptr(key->tfms);
+
+	if (ret)
+		printk(KERN_INFO "Some error occured while encrypting.\n");
+	else if (encrypt)
+		atomic_long_add(nr_pages, &sbi->stats.pages_encrypted);
+	else
+		atomic_long_add(nr_pages, &sbi->stats.pages_decrypted);
+out_unlock:
+	rcu_read_unlock();
+#ifdef EXTRA_CREDIT
+	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
+		DBGRET(ret);
+#endif
+	return ret;
+}
+
+/*
+ * Encrypt or decrypt the bytes [@from of the first page, @to of the
+ * last page) of a run of @nr_pages pages, @src_pages[i] into
+ * @dst_pages[i], through one scatterlist pair and one call to
+ * wrapfs_crypt_sg().  @from is rounded down to a counter block, or to
+ * the start of the page if the mode cannot seek; the result lands at
+ * the same offsets in @dst_pages.  Passing the same array twice works
+ * in place.  @src_pages sit at their file index in @inode, be they our
+ * pages or the lower file's.
+ */
+int wrapfs_crypt_page_range(struct inode *inode, struct page **src_pages,
+			    struct page **dst_pages, unsigned int nr_pages,
+			    size_t from, size_t to, int encrypt)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+	unsigned int ctr_block = sbi->crypt.mode->ctr_block;
+	struct scatterlist src_sg[WRAPFS_CRYPT_BATCH];
+	struct scatterlist dst_sg[WRAPFS_CRYPT_BATCH];
+	struct scatterlist *dst = dst_sg;
+	unsigned int i;
+
+	BUG_ON(!nr_pages || nr_pages > WRAPFS_CRYPT_BATCH);
+	from = ctr_block ? from - from % ctr_block : 0;
+	sg_init_table(src_sg, nr_pages);
+	for (i = 0; i < nr_pages; i++) {
+		size_t start = i ? 0 : from;
+		size_t end = (i == nr_pages - 1) ? to : PAGE_SIZE;
+
+		sg_set_page(&src_sg[i], src_pages[i], end - start, start);
+	}
+	if (dst_pages == src_pages) {
+		dst = src_sg;
+	} else {
+		sg_init_table(dst_sg, nr_pages);
+		for (i = 0; i < nr_pages; i++)
+			sg_set_page(&dst_sg[i], dst_pages[i],
+				    src_sg[i].length, src_sg[i].offset);
+	}
+	return wrapfs_crypt_sg(inode, src_pages[0]->index, dst, src_sg,
+			       nr_pages, encrypt);
+}
+
+/* wrapfs_crypt_page_range() over whole pages */
+int wrapfs_crypt_pages(struct inode *inode, struct page **src_pages,
+		       struct page **dst_pages, unsigned int nr_pages,
+		       int encrypt)
+{
+	return wrapfs_crypt_page_range(inode, src_pages, dst_pages, nr_pages,
+				       0, PAGE_SIZE, encrypt);
+}
+
+/*
+ This function is used to encrypt or decrypt a page.
+ inode		: the wrapfs inode the page belongs to
+ src_page	: the given page with data
+ dst_page	: the final page which is to be filled in
+ encrypt	: This is a flag whch determines whether the src_page needs
+ to be encrypted or deprypted.
+ 1: encrypt
+ 0: decrypt
+
+ returns 0 on success and appropriate negative error or failure
+ */
+int decrypt_encrypt_page(struct inode *inode,
+			 struct page *src_page,
+			 struct page *dst_page,
+			 int encrypt)
+{
+	if (src_page == dst_page)	/* in place */
+		return wrapfs_crypt_pages(inode, &src_page, &src_page, 1,
+					  encrypt);
+	return wrapfs_crypt_pages(inode, &src_page, &dst_page, 1, encrypt);
+}
+
+/* one in-flight async page request */
+struct wrapfs_crypt_req {
+	struct wrapfs_key *key;		/* referenced until completion */
+	struct scatterlist src_sg, dst_sg;
+	u8 iv[WRAPFS_MAX_IV_SIZE];
+	int encrypt;
+	void (*done)(void *data, int err);
+	void *data;
+	struct ablkcipher_request req;	/* must be last: tfm ctx follows */
+};
+
+static void wrapfs_crypt_req_finish(struct wrapfs_crypt_req *creq, int err)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(creq->key->sb);
+
+	if (!err)
+		atomic_long_inc(creq->encrypt ? &sbi->stats.pages_encrypted :
+				&sbi->stats.pages_decrypted);
+	/* before @done: once the page is unlocked, umount may proceed */
+	wrapfs_put_key(creq->key);
+	creq->done(creq->data, err);
+	kfree(creq);
+}
+
+/* crypto completion callback, usually in softirq context */
+static void wrapfs_crypt_async_done(struct crypto_async_request *areq,
+				    int err)
+{
+	/* a backlogged request has just been started, not finished */
+	if (err == -EINPROGRESS)
+		return;
+	wrapfs_crypt_req_finish(areq->data, err);
+}
+
+/*
+ * wrapfs_crypt_page_async
+ * @inode: the wrapfs inode the page belongs to
+ * @src_page: page with the input, at its file index
+ * @dst_page: page receiving the result; may be @src_page
+ * @encrypt: 1 to encrypt, 0 to decrypt
+ * @done: called exactly once with the result, possibly from softirq
+ *        context and possibly before this function returns
+ * @data: passed to @done
+ *
+ * Submit one page to the async transform.  The request holds a
+ * reference to the key until it completes, so a key change neither
+ * waits for in-flight requests nor frees the transform under them.
+ *
+ * Returns 0 if the request was accepted (@done will report the result),
+ * or -EAGAIN if there is no key, no async transform or no memory for the
+ * request; the caller then falls back to the synchronous path.
+ */
+int wrapfs_crypt_page_async(struct inode *inode, struct page *src_page,
+			    struct page *dst_page, int encrypt,
+			    void (*done)(void *data, int err), void *data)
+{
+	struct wrapfs_sb_info *sbi = WRAPFS_SB(inode->i_sb);
+	struct crypto_ablkcipher *atfm;
+	struct wrapfs_crypt_req *creq;
+	struct wrapfs_key *key;
+	int ret;
+
+	rcu_read_lock();
+	key = rcu_dereference(sbi->crypt.key);
+	if (key && (!key->atfm || !atomic_inc_not_zero(&key->count)))
+		key = NULL;
+	rcu_read_unlock();
+	if (!key)
+		goto out_fallback;
+	atfm = key->atfm;
+	creq = kmalloc(sizeof(*creq) + crypto_ablkcipher_reqsize(atfm),
+		       GFP_NOFS);
+	if (!creq) {
+		wrapfs_put_key(key);
+		goto out_fallback;
+	}
+
+	creq->key = key;
+	creq->encrypt = encrypt;
+	creq->done = done;
+	creq->data = data;
+	sbi->crypt.mode->make_iv(creq->iv, crypto_ablkcipher_ivsize(atfm),
+				 inode->i_ino, src_page->index, 0);
+	sg_init_table(&creq->src_sg, 1);
+	sg_init_table(&creq->dst_sg, 1);
+	sg_set_page(&creq->src_sg, src_page, PAGE_SIZE, 0);
+	sg_set_page(&creq->dst_sg, dst_page, PAGE_SIZE, 0);
+
+	ablkcipher_request_set_tfm(&creq->req, atfm);
+	ablkcipher_request_set_callback(&creq->req,
+					CRYPTO_TFM_REQ_MAY_BACKLOG,
+					wrapfs_crypt_async_done, creq);
+	ablkcipher_request_set_crypt(&creq->req, &creq->src_sg,
+				     &creq->dst_sg, PAGE_SIZE, creq->iv);
+	atomic_long_inc(&sbi->stats.async_submitted);
+	if (encrypt)
+		ret = crypto_ablkcipher_encrypt(&creq->req);
+	else
+		ret = crypto_ablkcipher_decrypt(&creq->req);
+	/* -EBUSY: backlogged, the callback still comes */
+	if (ret != -EINPROGRESS && ret != -EBUSY)
+		wrapfs_crypt_req_finish(creq, ret);
+	return 0;
+
+out_fallback:
+	atomic_long_inc(&sbi->stats.async_fallbacks);
+	return -EAGAIN;
+}
+#endif
@@ -11,33 +11,60 @@
 
 #include "wrapfs.h"
 
+/* ask the lower file system about @lower_path, in place of our dentry */
+static int wrapfs_lower_revalidate(struct path *lower_path,
+				   struct nameidata *nd)
+{
+	struct dentry *lower_dentry = lower_path->dentry;
+	struct path saved_path;
+	int err;
+
+	if (!lower_dentry->d_op || !lower_dentry->d_op->d_revalidate)
+		return 1;
+	if (!nd)
+		return lower_dentry->d_op->d_revalidate(lower_dentry, NULL);
+	pathcpy(&saved_path, &nd->path);
+	pathcpy(&nd->path, lower_path);
+	err = lower_dentry->d_op->d_revalidate(lower_dentry, nd);
+	pathcpy(&nd->path, &saved_path);
+	return err;
+}
+
 /*
+ * Only registered for dentries whose lower dentry has ->d_revalidate.
+ *
  * returns: -ERRNO if error (returned to user)
  *          0: tell VFS to invalidate dentry
  *          1: dentry is valid
  */
 static int wrapfs_d_revalidate(struct dentry *dentry, struct nameidata *nd)
 {
-	struct path lower_path, saved_path;
-	struct dentry *lower_dentry;
+	struct wrapfs_dentry_info *info;
+	struct path lower_path;
 	int err = 1;
 #ifdef EXTRA_CREDIT
 	if (debug_opt & D_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
-	if (nd && nd->flags & LOOKUP_RCU)
-		return -ECHILD;
+	if (nd && nd->flags & LOOKUP_RCU) {
+		/*
+		 * rcu-walk: no references, no sleeping.  Our private data
+		 * and the lower dentry are only freed after a grace period,
+		 * and the lower ->d_revalidate sees LOOKUP_RCU and answers
+		 * -ECHILD itself if it cannot do without blocking.
+		 */
+		info = ACCESS_ONCE(dentry->d_fsdata);
+		if (!info)
+			return -ECHILD;
+		lower_path.mnt = ACCESS_ONCE(info->lower_path.mnt);
+		lower_path.dentry = ACCESS_ONCE(info->lower_path.dentry);
+		if (!lower_path.dentry || !lower_path.mnt)
+			return -ECHILD;
+		return wrapfs_lower_revalidate(&lower_path, nd);
+	}
 
-	wrapfs_get_lower_path(dentry, &lower_path);
-	lower_dentry = lower_path.dentry;
-	if (!lower_dentry->d_op || !lower_dentry->d_op->d_revalidate)
-		goto out;
-	pathcpy(&saved_path, &nd->path);
-	pathcpy(&nd->path, &lower_path);
-	err = lower_dentry->d_op->d_revalidate(lower_dentry, nd);
-	pathcpy(&nd->path, &saved_path);
-out:
-	wrapfs_put_lower_path(dentry, &lower_path);
+	wrapfs_borrow_lower_path(dentry, &lower_path);
+	err = wrapfs_lower_revalidate(&lower_path, nd);
 #ifdef EXTRA_CREDIT
 	if (debug_opt & D_DOPS || debug_opt & ALL_DOPS)
 		DBGRET(err);
@@ -61,3 +88,8 @@ const struct dentry_operations wrapfs_dops = {
 	.d_revalidate	= wrapfs_d_revalidate,
 	.d_release	= wrapfs_d_release,
 };
+
+/* for lower file systems whose dentries never go stale */
+const struct dentry_operations wrapfs_dops_noreval = {
+	.d_release	= wrapfs_d_release,
+};
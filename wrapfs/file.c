@@ -10,6 +10,9 @@
  */
 #include <linux/scatterlist.h>
 #include <linux/crypto.h>
+#include <linux/falloc.h>
+#include <linux/compat.h>
+#include <linux/security.h>
 
 #include "wrapfs.h"
 
@@ -62,6 +65,287 @@ static ssize_t wrapfs_write(struct file *file, const char __user *buf,
 	return err;
 }
 
+static ssize_t wrapfs_splice_read(struct file *file, loff_t *ppos,
+				  struct pipe_inode_info *pipe, size_t len,
+				  unsigned int flags)
+{
+	ssize_t err;
+	struct file *lower_file;
+	struct dentry *dentry = file->f_path.dentry;
+#ifdef EXTRA_CREDIT
+	if (debug_opt & F_DOPS || debug_opt & ALL_DOPS)
+		UDBG;
+#endif
+	lower_file = wrapfs_lower_file(file);
+	if (!lower_file->f_op || !lower_file->f_op->splice_read) {
+		err = -EINVAL;
+		goto out;
+	}
+	err = lower_file->f_op->splice_read(lower_file, ppos, pipe, len,
+					    flags);
+	if (err >= 0)
+		fsstack_copy_attr_atime(dentry->d_inode,
+					lower_file->f_path.dentry->d_inode);
+out:
+#ifdef EXTRA_CREDIT
+	if (debug_opt & F_DOPS || debug_opt & ALL_DOPS)
+		DBGRET(err);
+#endif
+	return err;
+}
+
+static ssize_t wrapfs_splice_write(struct pipe_inode_info *pipe,
+				   struct file *file, loff_t *ppos, size_t len,
+				   unsigned int flags)
+{
+	ssize_t err;
+	struct file *lower_file;
+	struct dentry *dentry = file->f_path.dentry;
+#ifdef EXTRA_CREDIT
+	if (debug_opt & F_DOPS || debug_opt & ALL_DOPS)
+		UDBG;
+#endif
+	lower_file = wrapfs_lower_file(file);
+	if (!lower_file->f_op || !lower_file->f_op->splice_write) {
+		err = -EINVAL;
+		goto out;
+	}
+	err = lower_file->f_op->splice_write(pipe, lower_file, ppos, len,
+					     flags);
+	if (err >= 0) {
+		fsstack_copy_inode_size(dentry->d_inode,
+					lower_file->f_path.dentry->d_inode);
+		fsstack_copy_attr_times(dentry->d_inode,
+					lower_file->f_path.dentry->d_inode);
+	}
+out:
+#ifdef EXTRA_CREDIT
+	if (debug_opt & F_DOPS || debug_opt & ALL_DOPS)
+		DBGRET(err);
+#endif
+	return err;
+}
+
+#ifdef WRAPFS_CRYPTO
+void wrapfs_dir_cache_put(struct wrapfs_dir_cache *cache)
+{
+	struct wrapfs_dir_chunk *chunk, *next;
+
+	if (!cache || !atomic_dec_and_test(&cache->count))
+		return;
+	list_for_each_entry_safe(chunk, next, &cache->chunks, list)
+		kfree(chunk);
+	kfree(cache);
+}
+
+/* forget @dir's listing; under its i_mutex, or from evict_inode */
+void wrapfs_dir_cache_drop(struct inode *dir)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(dir);
+
+	wrapfs_dir_cache_put(info->dir_cache);
+	info->dir_cache = NULL;
+}
+
+struct wrapfs_dir_fill {
+	struct wrapfs_dir_cache *cache;
+	unsigned int added;
+	unsigned int long_names;
+	int err;
+};
+
+/* filldir for the lower readdir: append the entry, name still encrypted */
+static int wrapfs_dir_fill(void *buf, const char *name, int namlen,
+			   loff_t offset, u64 ino, unsigned int d_type)
+{
+	struct wrapfs_dir_fill *fill = buf;
+	struct list_head *chunks = &fill->cache->chunks;
+	struct wrapfs_dir_chunk *chunk = NULL;
+	struct wrapfs_dirent *de;
+	size_t reclen = namlen;
+
+	/* a long name's entry gets room for the name it stands for */
+	if (namlen == WRAPFS_LONG_NAME_LEN &&
+	    name[0] == WRAPFS_LONG_NAME_PREFIX) {
+		reclen = NAME_MAX;
+		fill->long_names++;
+	}
+	reclen = ALIGN(offsetof(struct wrapfs_dirent, name) + reclen,
+		       sizeof(u64));
+
+	if (!list_empty(chunks))
+		chunk = list_entry(chunks->prev, struct wrapfs_dir_chunk,
+				   list);
+	if (!chunk || chunk->used + reclen > WRAPFS_DIR_CHUNK_SIZE -
+	    offsetof(struct wrapfs_dir_chunk, data)) {
+		chunk = kmalloc(WRAPFS_DIR_CHUNK_SIZE, GFP_KERNEL);
+		if (!chunk) {
+			fill->err = -ENOMEM;
+			return -ENOMEM;
+		}
+		chunk->used = 0;
+		list_add_tail(&chunk->list, chunks);
+	}
+	de = (struct wrapfs_dirent *)(chunk->data + chunk->used);
+	de->ino = ino;
+	de->reclen = reclen;
+	de->namlen = namlen;
+	de->d_type = d_type;
+	memcpy(de->name, name, namlen);
+	chunk->used += reclen;
+	fill->added++;
+	return 0;
+}
+
+/*
+ * Get a reference to the decrypted listing of @file's directory.  The
+ * one on the inode is used as long as the lower directory's i_version
+ * and mtime and the key are what they were when it was built; else the
+ * whole lower directory is read into chunks, and each chunk's names are
+ * decrypted in one go.  If any lower name is a long one, the directory's
+ * long name index is read once for them all.  Called under the
+ * directory's i_mutex.
+ */
+static struct wrapfs_dir_cache *wrapfs_dir_cache_get(struct file *file)
+{
+	struct inode *inode = file->f_path.dentry->d_inode;
+	struct inode *lower_inode = wrapfs_lower_inode(inode);
+	struct file *lower_file = wrapfs_lower_file(file);
+	struct wrapfs_dir_cache *cache = WRAPFS_I(inode)->dir_cache;
+	long key_gen = atomic_long_read(&WRAPFS_SB(inode->i_sb)->stats.setkeys);
+	struct wrapfs_long_names *names = NULL;
+	struct wrapfs_dir_chunk *chunk;
+	struct wrapfs_dir_fill fill;
+	loff_t pos;
+	int err;
+
+	if (cache && cache->version == lower_inode->i_version &&
+	    timespec_equal(&cache->mtime, &lower_inode->i_mtime) &&
+	    cache->key_gen == key_gen)
+		goto out;
+
+	wrapfs_dir_cache_drop(inode);
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache)
+		return ERR_PTR(-ENOMEM);
+	atomic_set(&cache->count, 1);
+	INIT_LIST_HEAD(&cache->chunks);
+	/* taken first: a change made while we read shows up next time */
+	cache->version = lower_inode->i_version;
+	cache->mtime = lower_inode->i_mtime;
+	cache->key_gen = key_gen;
+
+	pos = vfs_llseek(lower_file, 0, SEEK_SET);
+	if (pos < 0) {
+		err = pos;
+		goto out_put;
+	}
+	fill.cache = cache;
+	fill.long_names = 0;
+	fill.err = 0;
+	do {
+		fill.added = 0;
+		err = vfs_readdir(lower_file, wrapfs_dir_fill, &fill);
+	} while (!err && !fill.err && fill.added);
+	if (!err)
+		err = fill.err;
+	if (err)
+		goto out_put;
+	if (fill.long_names) {
+		names = wrapfs_long_names_load(inode->i_sb,
+					       &lower_file->f_path);
+		if (IS_ERR(names)) {
+			err = PTR_ERR(names);
+			names = NULL;
+			goto out_put;
+		}
+	}
+	list_for_each_entry(chunk, &cache->chunks, list) {
+		err = wrapfs_decrypt_dirents(inode->i_sb, chunk, names);
+		if (err)
+			goto out_put;
+	}
+	wrapfs_long_names_free(names);
+	fsstack_copy_attr_atime(inode, lower_inode);
+	WRAPFS_I(inode)->dir_cache = cache;
+out:
+	atomic_inc(&cache->count);
+	return cache;
+out_put:
+	wrapfs_long_names_free(names);
+	wrapfs_dir_cache_put(cache);
+	return ERR_PTR(err);
+}
+
+static void wrapfs_dir_rewind(struct wrapfs_file_info *fi)
+{
+	struct list_head *chunks = &fi->dir_cache->chunks;
+
+	fi->dir_chunk = list_empty(chunks) ? NULL :
+		list_first_entry(chunks, struct wrapfs_dir_chunk, list);
+	fi->dir_off = 0;
+	fi->dir_pos = 0;
+}
+
+/* move the cursor past the entry it is on */
+static void wrapfs_dir_next(struct wrapfs_file_info *fi)
+{
+	struct wrapfs_dirent *de;
+
+	de = (struct wrapfs_dirent *)(fi->dir_chunk->data + fi->dir_off);
+	fi->dir_off += de->reclen;
+	fi->dir_pos++;
+	if (fi->dir_off < fi->dir_chunk->used)
+		return;
+	fi->dir_off = 0;
+	if (list_is_last(&fi->dir_chunk->list, &fi->dir_cache->chunks))
+		fi->dir_chunk = NULL;
+	else
+		fi->dir_chunk = list_entry(fi->dir_chunk->list.next,
+					   struct wrapfs_dir_chunk, list);
+}
+
+/*
+ * readdir of an encnames directory, served from its decrypted listing.
+ * f_pos is the index of an entry in the listing.  Reading from 0 picks
+ * up the current listing; until then the open directory stays on the
+ * one it has, so a rebuild never moves entries under a reader.
+ */
+static int wrapfs_readdir_cached(struct file *file, void *dirent,
+				 filldir_t filldir)
+{
+	struct wrapfs_file_info *fi = WRAPFS_F(file);
+
+	if (!file->f_pos || !fi->dir_cache) {
+		struct wrapfs_dir_cache *cache = wrapfs_dir_cache_get(file);
+
+		if (IS_ERR(cache))
+			return PTR_ERR(cache);
+		wrapfs_dir_cache_put(fi->dir_cache);
+		fi->dir_cache = cache;
+		wrapfs_dir_rewind(fi);
+	}
+	/* the cursor only goes forwards: seekdir back starts over */
+	if (fi->dir_pos > file->f_pos)
+		wrapfs_dir_rewind(fi);
+	while (fi->dir_chunk && fi->dir_pos < file->f_pos)
+		wrapfs_dir_next(fi);
+
+	while (fi->dir_chunk) {
+		struct wrapfs_dirent *de = (struct wrapfs_dirent *)
+			(fi->dir_chunk->data + fi->dir_off);
+
+		/* a lower entry that is not a name of ours has no name */
+		if (de->namlen && filldir(dirent, de->name, de->namlen,
+					  file->f_pos, de->ino, de->d_type))
+			break;
+		wrapfs_dir_next(fi);
+		file->f_pos = fi->dir_pos;
+	}
+	return 0;
+}
+#endif
+
 static int wrapfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 {
 	int err = 0;
@@ -72,11 +356,22 @@ static int wrapfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 		UDBG;
 #endif
 	lower_file = wrapfs_lower_file(file);
+#ifdef WRAPFS_CRYPTO
+	if (wrapfs_encnames(dentry->d_sb)) {
+		err = -ENOKEY;
+		if (wrapfs_has_key(dentry->d_sb))
+			err = wrapfs_readdir_cached(file, dirent, filldir);
+		goto out;
+	}
+#endif
 	err = vfs_readdir(lower_file, filldir, dirent);
 	file->f_pos = lower_file->f_pos;
 	if (err >= 0)		/* copy the atime */
 		fsstack_copy_attr_atime(dentry->d_inode,
 					lower_file->f_path.dentry->d_inode);
+#ifdef WRAPFS_CRYPTO
+out:
+#endif
 #ifdef EXTRA_CREDIT
 	if (debug_opt & F_DOPS || debug_opt & ALL_DOPS)
 		DBGRET(err);
@@ -84,13 +379,108 @@ static int wrapfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 	return err;
 }
 
+/* regular files in address-space mode do their I/O through the page cache */
+static inline bool wrapfs_uses_lower_file(struct inode *inode)
+{
+	return inode->i_fop == &wrapfs_main_fops_add_space;
+}
+
+/*
+ * What rw_verify_area() checks before a read or write, which modules
+ * can't call: mandatory locks on the range and the LSM's say.
+ */
+static int wrapfs_verify_area(int read_write, struct file *file,
+			      loff_t pos, size_t count)
+{
+	struct inode *inode = file->f_path.dentry->d_inode;
+	int err;
+
+	if (inode->i_flock && mandatory_lock(inode)) {
+		err = locks_mandatory_area(read_write == READ ?
+					   FLOCK_VERIFY_READ :
+					   FLOCK_VERIFY_WRITE,
+					   inode, file, pos, count);
+		if (err)
+			return err;
+	}
+	return security_file_permission(file, read_write == READ ?
+					MAY_READ : MAY_WRITE);
+}
+
+/*
+ * WRAPFS_IOC_COPY_RANGE: copy from another address-space mode file of
+ * this mount into @file, which must be open for writing.  It is a write
+ * to @file and a read of the source, with the checks of either, like
+ * do_splice_direct().
+ */
+static long wrapfs_ioctl_copy_range(struct file *file,
+				    struct wrapfs_copy_range __user *argp)
+{
+	struct wrapfs_copy_range args;
+	struct inode *inode = file->f_path.dentry->d_inode;
+	struct inode *src_inode;
+	struct file *src;
+	long err;
+
+	if (copy_from_user(&args, argp, sizeof(args)))
+		return -EFAULT;
+	if ((loff_t)args.src_offset < 0 || (loff_t)args.dst_offset < 0 ||
+	    (loff_t)(args.src_offset + args.len) < 0 ||
+	    (loff_t)(args.dst_offset + args.len) < 0)
+		return -EINVAL;
+	args.len = min_t(u64, args.len, MAX_RW_COUNT);
+	if (!(file->f_mode & FMODE_WRITE) || (file->f_flags & O_APPEND))
+		return -EBADF;
+	src = fget(args.src_fd);
+	if (!src)
+		return -EBADF;
+	src_inode = src->f_path.dentry->d_inode;
+	err = -EBADF;
+	if (!(src->f_mode & FMODE_READ))
+		goto out;
+	err = -EXDEV;
+	if (src_inode->i_sb != inode->i_sb)
+		goto out;
+	err = -EOPNOTSUPP;
+	if (!wrapfs_uses_lower_file(src_inode) ||
+	    !wrapfs_uses_lower_file(inode))
+		goto out;
+	err = -EINVAL;
+	if (src_inode == inode &&
+	    args.src_offset < args.dst_offset + args.len &&
+	    args.dst_offset < args.src_offset + args.len)
+		goto out;
+	err = -EFBIG;
+	if (args.dst_offset + args.len > inode->i_sb->s_maxbytes)
+		goto out;
+	err = wrapfs_verify_area(READ, src, args.src_offset, args.len);
+	if (!err)
+		err = wrapfs_verify_area(WRITE, file, args.dst_offset,
+					 args.len);
+	if (err)
+		goto out;
+
+	mutex_lock(&inode->i_mutex);
+	err = file_remove_suid(file);
+	if (!err) {
+		/* the raw copy takes the lower times over this */
+		file_update_time(file);
+		err = wrapfs_copy_range(src, args.src_offset, file,
+					args.dst_offset, args.len);
+	}
+	mutex_unlock(&inode->i_mutex);
+out:
+	fput(src);
+	return err;
+}
+
 static long wrapfs_unlocked_ioctl(struct file *file, unsigned int cmd,
 				  unsigned long arg)
 {
 	long err = -ENOTTY;
 	struct file *lower_file;
 #ifdef WRAPFS_CRYPTO
-	int keylen = sizeof(WRAPFS_SB(file->f_dentry->d_sb)->key);
+	int keylen = WRAPFS_KEY_SIZE + 1;
 	/*Here goes the code for our ioctl*/
 	char *key = NULL;
 	struct scatterlist sg;
@@ -98,12 +488,19 @@ static long wrapfs_unlocked_ioctl(struct file *file, unsigned int cmd,
 	struct hash_desc desc;
 	const char *algo = "md5";
 	char result[33];
+	u8 raw[WRAPFS_KEY_SIZE];
 	int i = 0;
 	int has_all_zeros = 1;
+#endif
 #ifdef EXTRA_CREDIT
 	if (debug_opt & F_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
+	if (cmd == WRAPFS_IOC_COPY_RANGE) {
+		err = wrapfs_ioctl_copy_range(file, (void __user *)arg);
+		goto out;
+	}
+#ifdef WRAPFS_CRYPTO
 	key = kmalloc(keylen, GFP_KERNEL);
 	if (!key) {
 		err = -ENOMEM;
@@ -122,10 +519,8 @@ static long wrapfs_unlocked_ioctl(struct file *file, unsigned int cmd,
 		}
 	}
 	if (has_all_zeros) {
-		memset(WRAPFS_SB(file->f_dentry->d_sb)->key, 0,
-			   sizeof(WRAPFS_SB(file->f_dentry->d_sb)->key));
-		printk(KERN_INFO "Stored key: %s\n",
-			   WRAPFS_SB(file->f_dentry->d_sb)->key);
+		wrapfs_crypt_clearkey(file->f_dentry->d_sb);
+		printk(KERN_INFO "Key cleared\n");
 		goto out_key;
 	}
 	/*calculate the md5 hash of the key*/
@@ -156,9 +551,16 @@ static long wrapfs_unlocked_ioctl(struct file *file, unsigned int cmd,
 		}
 	result[32] = '\0';
 
-	strncpy(WRAPFS_SB(file->f_dentry->d_sb)->key,
-		   result,
-		   sizeof(keylen));
+	/* same key bytes as always, or existing files won't decrypt */
+	memset(raw, 0, sizeof(raw));
+	strncpy((char *)raw, result, sizeof(keylen));
+
+	/* key the per-cpu transforms once, here, rather than on every page */
+	err = wrapfs_crypt_setkey(file->f_dentry->d_sb, raw, sizeof(raw));
+	memset(raw, 0, sizeof(raw));
+	memset(result, 0, sizeof(result));
+	if (err)
+		goto out_key;
 
 	/*Here ends the code for our ioctl*/
 #endif
@@ -191,6 +593,10 @@ static long wrapfs_compat_ioctl(struct file *file, unsigned int cmd,
 	if (debug_opt & F_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
+	if (cmd == WRAPFS_IOC_COPY_RANGE) {
+		err = wrapfs_ioctl_copy_range(file, compat_ptr(arg));
+		goto out;
+	}
 	lower_file = wrapfs_lower_file(file);
 
 	/* XXX: use vfs_ioctl if/when VFS exports it */
@@ -218,6 +624,18 @@ static int wrapfs_mmap(struct file *file, struct vm_area_struct *vma)
 	if (debug_opt & F_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
+	if (wrapfs_uses_lower_file(file->f_path.dentry->d_inode)) {
+		/*
+		 * Map our own page cache, filled by ->readpage, rather than
+		 * the lower file's: its pages hold ciphertext.  All that is
+		 * needed from generic_file_mmap, with our ->page_mkwrite.
+		 */
+		file_accessed(file);
+		vma->vm_ops = &wrapfs_vm_ops_add_space;
+		vma->vm_flags |= VM_CAN_NONLINEAR;
+		goto out;
+	}
+
 	/* this might be deferred to mmap's writepage */
 	willwrite = ((vma->vm_flags | VM_SHARED | VM_WRITE) == vma->vm_flags);
 
@@ -279,6 +697,77 @@ out:
 	return err;
 }
 
+/*
+ * Open the lower file shared by all opens of @inode, or upgrade it to
+ * read-write when a writer shows up after read-only opens.  Writeback
+ * encrypts into it long after the opener's own file may be gone.
+ * @mode is the f_mode of the open, or FMODE_WRITE for a size change
+ * made by path, which holds the lower file like a short-lived open.
+ */
+int wrapfs_get_lower_file(struct dentry *dentry, struct inode *inode,
+			  fmode_t mode)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct file *lower_file, *old_file;
+	struct path lower_path;
+	int flags = O_RDWR | O_LARGEFILE;
+	int err = 0;
+
+	mutex_lock(&info->lower_file_mutex);
+	old_file = info->lower_file;
+	if (old_file && (old_file->f_mode & FMODE_WRITE ||
+			 !(mode & FMODE_WRITE)))
+		goto out_count;
+
+	/* dentry_open consumes the path references, even on failure */
+	wrapfs_get_lower_path(dentry, &lower_path);
+	lower_file = dentry_open(lower_path.dentry, lower_path.mnt, flags,
+				 current_cred());
+	if (IS_ERR(lower_file) && !(mode & FMODE_WRITE)) {
+		flags = O_RDONLY | O_LARGEFILE;
+		wrapfs_get_lower_path(dentry, &lower_path);
+		lower_file = dentry_open(lower_path.dentry, lower_path.mnt,
+					 flags, current_cred());
+	}
+	if (IS_ERR(lower_file)) {
+		err = PTR_ERR(lower_file);
+		goto out_unlock;
+	}
+
+	spin_lock(&info->lower_file_lock);
+	info->lower_file = lower_file;
+	spin_unlock(&info->lower_file_lock);
+	if (old_file)
+		fput(old_file);
+out_count:
+	info->lower_file_count++;
+out_unlock:
+	mutex_unlock(&info->lower_file_mutex);
+	return err;
+}
+
+/*
+ * Drop one open's hold on the shared lower file.  The last one out
+ * writes back the dirty pages first, since they need the lower file.
+ */
+void wrapfs_put_lower_file(struct inode *inode)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct file *lower_file = NULL;
+
+	mutex_lock(&info->lower_file_mutex);
+	if (--info->lower_file_count == 0) {
+		filemap_write_and_wait(inode->i_mapping);
+		spin_lock(&info->lower_file_lock);
+		lower_file = info->lower_file;
+		info->lower_file = NULL;
+		spin_unlock(&info->lower_file_lock);
+	}
+	mutex_unlock(&info->lower_file_mutex);
+	if (lower_file)
+		fput(lower_file);
+}
+
 static int wrapfs_open(struct inode *inode, struct file *file)
 {
 	int err = 0;
@@ -316,6 +805,15 @@ static int wrapfs_open(struct inode *inode, struct file *file)
 		wrapfs_set_lower_file(file, lower_file);
 	}
 
+	if (!err && wrapfs_uses_lower_file(inode)) {
+		err = wrapfs_get_lower_file(file->f_path.dentry, inode,
+					    file->f_mode);
+		if (err) {
+			wrapfs_set_lower_file(file, NULL);
+			fput(lower_file);
+		}
+	}
+
 	if (err)
 		kfree(WRAPFS_F(file));
 	else
@@ -359,6 +857,11 @@ static int wrapfs_file_release(struct inode *inode, struct file *file)
 		wrapfs_set_lower_file(file, NULL);
 		fput(lower_file);
 	}
+	if (wrapfs_uses_lower_file(inode))
+		wrapfs_put_lower_file(inode);
+#ifdef WRAPFS_CRYPTO
+	wrapfs_dir_cache_put(WRAPFS_F(file)->dir_cache);
+#endif
 
 	kfree(WRAPFS_F(file));
 #ifdef EXTRA_CREDIT
@@ -373,8 +876,6 @@ static int wrapfs_fsync(struct file *file, loff_t start, loff_t end,
 {
 	int err;
 	struct file *lower_file;
-	struct path lower_path;
-	struct dentry *dentry = file->f_path.dentry;
 #ifdef EXTRA_CREDIT
 	if (debug_opt & F_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
@@ -383,9 +884,7 @@ static int wrapfs_fsync(struct file *file, loff_t start, loff_t end,
 	if (err)
 		goto out;
 	lower_file = wrapfs_lower_file(file);
-	wrapfs_get_lower_path(dentry, &lower_path);
 	err = vfs_fsync_range(lower_file, start, end, datasync);
-	wrapfs_put_lower_path(dentry, &lower_path);
 out:
 #ifdef EXTRA_CREDIT
 	if (debug_opt & F_DOPS || debug_opt & ALL_DOPS)
@@ -411,8 +910,164 @@ static int wrapfs_fasync(int fd, struct file *file, int flag)
 #endif
 	return err;
 }
+/*
+ * SEEK_DATA and SEEK_HOLE are answered by the lower file, whose holes are
+ * ours: ciphertext sits at the offsets of its plaintext.  Dirty pages are
+ * written back first, or data not yet in the lower file would look like
+ * a hole.  Encrypted files have holes only in whole pages, so the answer
+ * is rounded out to pages for lower filesystems with smaller blocks.
+ */
+static loff_t wrapfs_file_llseek(struct file *file, loff_t offset, int origin)
+{
+	struct inode *inode = file->f_path.dentry->d_inode;
+	struct file *lower_file;
+	loff_t rc;
+#ifdef EXTRA_CREDIT
+	if (debug_opt & F_DOPS || debug_opt & ALL_DOPS)
+		UDBG;
+#endif
+	if (origin != SEEK_DATA && origin != SEEK_HOLE) {
+		rc = generic_file_llseek(file, offset, origin);
+		goto out;
+	}
+	rc = filemap_write_and_wait(inode->i_mapping);
+	if (rc)
+		goto out;
+	lower_file = wrapfs_lower_file(file);
+	rc = vfs_llseek(lower_file, offset, origin);
+	if (rc < 0)
+		goto out;
+#ifdef WRAPFS_CRYPTO
+	if (wrapfs_uses_lower_file(inode)) {
+		if (origin == SEEK_DATA)
+			rc = max_t(loff_t, offset,
+				   rc - (rc & ~PAGE_CACHE_MASK));
+		else
+			rc = min_t(loff_t, round_up(rc, PAGE_CACHE_SIZE),
+				   i_size_read(inode));
+	}
+#endif
+	if (rc != file->f_pos) {
+		file->f_pos = rc;
+		file->f_version = 0;
+	}
+out:
+#ifdef EXTRA_CREDIT
+	if (debug_opt & F_DOPS || debug_opt & ALL_DOPS)
+		DBGRET(rc);
+#endif
+	return rc;
+}
+
+/*
+ * Punch a hole in an address-space mode file: write back what is dirty
+ * in the range, punch the lower file and drop our pages of the range so
+ * they are read again.  Encrypted files get holes in whole pages only
+ * (a part of a page read back as zeros would decrypt to garbage), so
+ * the partial pages at either end are overwritten with zeros instead.
+ */
+static long wrapfs_punch_hole(struct file *file, loff_t offset, loff_t len)
+{
+	struct inode *inode = file->f_path.dentry->d_inode;
+	struct file *lower_file = wrapfs_lower_file(file);
+	loff_t end = offset + len;
+	loff_t pstart = offset, pend = end;
+	long err;
+
+	err = filemap_write_and_wait_range(inode->i_mapping, offset, end - 1);
+	if (err)
+		return err;
+#ifdef WRAPFS_CRYPTO
+	pstart = round_up(offset, PAGE_CACHE_SIZE);
+	pend = end - (end & ~PAGE_CACHE_MASK);
+#endif
+	if (pstart < pend) {
+		err = lower_file->f_op->fallocate(lower_file,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				pstart, pend - pstart);
+		if (err)
+			return err;
+	}
+	invalidate_inode_pages2_range(inode->i_mapping,
+				      offset >> PAGE_CACHE_SHIFT,
+				      (end - 1) >> PAGE_CACHE_SHIFT);
+#ifdef WRAPFS_CRYPTO
+	end = min(end, i_size_read(inode));
+	if (pstart >= pend)
+		return wrapfs_zero_range(inode, offset, end, file);
+	err = wrapfs_zero_range(inode, offset, min(pstart, end), file);
+	if (!err)
+		err = wrapfs_zero_range(inode, pend, end, file);
+#endif
+	return err;
+}
+
+/*
+ * fallocate goes to the lower file.  In address-space mode i_size is
+ * ours to keep, and may be ahead of the lower file's until writeback:
+ * an encrypted file grows through wrapfs_truncate(), which writes the
+ * partial pages at the old and new EOF, after the lower file has
+ * allocated the blocks with its size left alone.  Preallocated blocks
+ * read back as zeros, i.e. as holes.
+ */
+static long wrapfs_fallocate(struct file *file, int mode, loff_t offset,
+			     loff_t len)
+{
+	struct inode *inode = file->f_path.dentry->d_inode;
+	struct file *lower_file = wrapfs_lower_file(file);
+	struct inode *lower_inode = lower_file->f_path.dentry->d_inode;
+	loff_t end = offset + len;
+	long err;
+#ifdef EXTRA_CREDIT
+	if (debug_opt & F_DOPS || debug_opt & ALL_DOPS)
+		UDBG;
+#endif
+	if (!lower_file->f_op || !lower_file->f_op->fallocate) {
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+	if (!wrapfs_uses_lower_file(inode)) {
+		err = lower_file->f_op->fallocate(lower_file, mode, offset,
+						  len);
+		if (!err) {
+			fsstack_copy_inode_size(inode, lower_inode);
+			fsstack_copy_attr_times(inode, lower_inode);
+		}
+		goto out;
+	}
+
+	mutex_lock(&inode->i_mutex);
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		err = wrapfs_punch_hole(file, offset, len);
+	} else {
+#ifdef WRAPFS_CRYPTO
+		err = lower_file->f_op->fallocate(lower_file,
+						  mode | FALLOC_FL_KEEP_SIZE,
+						  offset, len);
+		if (!err && !(mode & FALLOC_FL_KEEP_SIZE) &&
+		    end > i_size_read(inode))
+			err = wrapfs_truncate(file->f_path.dentry, end, file);
+#else
+		err = lower_file->f_op->fallocate(lower_file, mode, offset,
+						  len);
+		if (!err && !(mode & FALLOC_FL_KEEP_SIZE) &&
+		    end > i_size_read(inode))
+			i_size_write(inode, end);
+#endif
+	}
+	if (!err)
+		fsstack_copy_attr_times(inode, lower_inode);
+	mutex_unlock(&inode->i_mutex);
+out:
+#ifdef EXTRA_CREDIT
+	if (debug_opt & F_DOPS || debug_opt & ALL_DOPS)
+		DBGRET(err);
+#endif
+	return err;
+}
+
 const struct file_operations wrapfs_main_fops_add_space = {
-	.llseek		= generic_file_llseek,
+	.llseek		= wrapfs_file_llseek,
 	/*
 	 The methods below are replaced to support address space operations
 	 .read		= wrapfs_read,
@@ -421,6 +1076,12 @@ const struct file_operations wrapfs_main_fops_add_space = {
 	.aio_read	= generic_file_aio_read,
 	.write		= do_sync_write,
 	.aio_write = generic_file_aio_write,
+	/*
+	 splice goes through our page cache too: sendfile() hands out the
+	 decrypted pages, and splice_write() lands in ->write_begin/end, so
+	 the data is encrypted by writeback like any other write.*/
+	.splice_read	= generic_file_splice_read,
+	.splice_write	= generic_file_splice_write,
 	.unlocked_ioctl	= wrapfs_unlocked_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl	= wrapfs_compat_ioctl,
@@ -431,11 +1092,14 @@ const struct file_operations wrapfs_main_fops_add_space = {
 	.release	= wrapfs_file_release,
 	.fsync		= wrapfs_fsync,
 	.fasync		= wrapfs_fasync,
+	.fallocate	= wrapfs_fallocate,
 };
 const struct file_operations wrapfs_main_fops = {
-	.llseek		= generic_file_llseek,
+	.llseek		= wrapfs_file_llseek,
 	.read		= wrapfs_read,
 	.write		= wrapfs_write,
+	.splice_read	= wrapfs_splice_read,
+	.splice_write	= wrapfs_splice_write,
 	.unlocked_ioctl	= wrapfs_unlocked_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl	= wrapfs_compat_ioctl,
@@ -446,6 +1110,7 @@ const struct file_operations wrapfs_main_fops = {
 	.release	= wrapfs_file_release,
 	.fsync		= wrapfs_fsync,
 	.fasync		= wrapfs_fasync,
+	.fallocate	= wrapfs_fallocate,
 };
 
 /* trimmed directory options */
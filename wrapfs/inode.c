@@ -14,7 +14,7 @@
 static int wrapfs_create(struct inode *dir, struct dentry *dentry,
 			 int mode, struct nameidata *nd)
 {
-	int err = 0;
+	int err = 0, added;
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path, saved_path;
@@ -22,24 +22,34 @@ static int wrapfs_create(struct inode *dir, struct dentry *dentry,
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
-	wrapfs_get_lower_path(dentry, &lower_path);
+	wrapfs_borrow_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	lower_parent_dentry = lock_parent(lower_dentry);
 
 	err = mnt_want_write(lower_path.mnt);
 	if (err)
 		goto out_unlock;
+	err = wrapfs_long_name_add(dentry, lower_parent_dentry,
+				   lower_path.mnt);
+	if (err < 0)
+		goto out;
+	added = err;
 
 	pathcpy(&saved_path, &nd->path);
 	pathcpy(&nd->path, &lower_path);
 	err = vfs_create(lower_parent_dentry->d_inode, lower_dentry, mode, nd);
 	pathcpy(&nd->path, &saved_path);
-	if (err)
+	if (err) {
+		if (added)
+			wrapfs_long_name_remove(dentry, lower_parent_dentry,
+						lower_path.mnt);
 		goto out;
+	}
 
 	err = wrapfs_interpose(dentry, dir->i_sb, &lower_path);
 	if (err)
 		goto out;
+	wrapfs_dir_changed(dir);
 	fsstack_copy_attr_times(dir, wrapfs_lower_inode(dir));
 	fsstack_copy_inode_size(dir, lower_parent_dentry->d_inode);
 
@@ -47,7 +57,6 @@ out:
 	mnt_drop_write(lower_path.mnt);
 out_unlock:
 	unlock_dir(lower_parent_dentry);
-	wrapfs_put_lower_path(dentry, &lower_path);
 #ifdef EXTRA_CREDIT
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		DBGRET(err);
@@ -62,15 +71,15 @@ static int wrapfs_link(struct dentry *old_dentry, struct inode *dir,
 	struct dentry *lower_new_dentry;
 	struct dentry *lower_dir_dentry;
 	u64 file_size_save;
-	int err;
+	int err, added;
 	struct path lower_old_path, lower_new_path;
 #ifdef EXTRA_CREDIT
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
 	file_size_save = i_size_read(old_dentry->d_inode);
-	wrapfs_get_lower_path(old_dentry, &lower_old_path);
-	wrapfs_get_lower_path(new_dentry, &lower_new_path);
+	wrapfs_borrow_lower_path(old_dentry, &lower_old_path);
+	wrapfs_borrow_lower_path(new_dentry, &lower_new_path);
 	lower_old_dentry = lower_old_path.dentry;
 	lower_new_dentry = lower_new_path.dentry;
 	lower_dir_dentry = lock_parent(lower_new_dentry);
@@ -79,14 +88,23 @@ static int wrapfs_link(struct dentry *old_dentry, struct inode *dir,
 	if (err)
 		goto out_unlock;
 
+	err = wrapfs_long_name_add(new_dentry, lower_dir_dentry,
+				   lower_new_path.mnt);
+	if (err < 0)
+		goto out;
+	added = err;
 	err = vfs_link(lower_old_dentry, lower_dir_dentry->d_inode,
 		       lower_new_dentry);
+	if (err && added)
+		wrapfs_long_name_remove(new_dentry, lower_dir_dentry,
+					lower_new_path.mnt);
 	if (err || !lower_new_dentry->d_inode)
 		goto out;
 
 	err = wrapfs_interpose(new_dentry, dir->i_sb, &lower_new_path);
 	if (err)
 		goto out;
+	wrapfs_dir_changed(dir);
 	fsstack_copy_attr_times(dir, lower_new_dentry->d_inode);
 	fsstack_copy_inode_size(dir, lower_new_dentry->d_inode);
 	set_nlink(old_dentry->d_inode,
@@ -96,8 +114,6 @@ out:
 	mnt_drop_write(lower_new_path.mnt);
 out_unlock:
 	unlock_dir(lower_dir_dentry);
-	wrapfs_put_lower_path(old_dentry, &lower_old_path);
-	wrapfs_put_lower_path(new_dentry, &lower_new_path);
 #ifdef EXTRA_CREDIT
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		DBGRET(err);
@@ -116,7 +132,7 @@ static int wrapfs_unlink(struct inode *dir, struct dentry *dentry)
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
-	wrapfs_get_lower_path(dentry, &lower_path);
+	wrapfs_borrow_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	dget(lower_dentry);
 	lower_dir_dentry = lock_parent(lower_dentry);
@@ -137,6 +153,8 @@ static int wrapfs_unlink(struct inode *dir, struct dentry *dentry)
 		err = 0;
 	if (err)
 		goto out;
+	wrapfs_long_name_remove(dentry, lower_dir_dentry, lower_path.mnt);
+	wrapfs_dir_changed(dir);
 	fsstack_copy_attr_times(dir, lower_dir_inode);
 	fsstack_copy_inode_size(dir, lower_dir_inode);
 	set_nlink(dentry->d_inode,
@@ -148,7 +166,6 @@ out:
 out_unlock:
 	unlock_dir(lower_dir_dentry);
 	dput(lower_dentry);
-	wrapfs_put_lower_path(dentry, &lower_path);
 #ifdef EXTRA_CREDIT
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		DBGRET(err);
@@ -159,7 +176,7 @@ out_unlock:
 static int wrapfs_symlink(struct inode *dir, struct dentry *dentry,
 			  const char *symname)
 {
-	int err = 0;
+	int err = 0, added;
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
@@ -167,19 +184,29 @@ static int wrapfs_symlink(struct inode *dir, struct dentry *dentry,
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
-	wrapfs_get_lower_path(dentry, &lower_path);
+	wrapfs_borrow_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	lower_parent_dentry = lock_parent(lower_dentry);
 
 	err = mnt_want_write(lower_path.mnt);
 	if (err)
 		goto out_unlock;
+	err = wrapfs_long_name_add(dentry, lower_parent_dentry,
+				   lower_path.mnt);
+	if (err < 0)
+		goto out;
+	added = err;
 	err = vfs_symlink(lower_parent_dentry->d_inode, lower_dentry, symname);
-	if (err)
+	if (err) {
+		if (added)
+			wrapfs_long_name_remove(dentry, lower_parent_dentry,
+						lower_path.mnt);
 		goto out;
+	}
 	err = wrapfs_interpose(dentry, dir->i_sb, &lower_path);
 	if (err)
 		goto out;
+	wrapfs_dir_changed(dir);
 	fsstack_copy_attr_times(dir, wrapfs_lower_inode(dir));
 	fsstack_copy_inode_size(dir, lower_parent_dentry->d_inode);
 
@@ -187,7 +214,6 @@ out:
 	mnt_drop_write(lower_path.mnt);
 out_unlock:
 	unlock_dir(lower_parent_dentry);
-	wrapfs_put_lower_path(dentry, &lower_path);
 #ifdef EXTRA_CREDIT
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		DBGRET(err);
@@ -197,7 +223,7 @@ out_unlock:
 
 static int wrapfs_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 {
-	int err = 0;
+	int err = 0, added;
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
@@ -205,21 +231,31 @@ static int wrapfs_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
-	wrapfs_get_lower_path(dentry, &lower_path);
+	wrapfs_borrow_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	lower_parent_dentry = lock_parent(lower_dentry);
 
 	err = mnt_want_write(lower_path.mnt);
 	if (err)
 		goto out_unlock;
+	err = wrapfs_long_name_add(dentry, lower_parent_dentry,
+				   lower_path.mnt);
+	if (err < 0)
+		goto out;
+	added = err;
 	err = vfs_mkdir(lower_parent_dentry->d_inode, lower_dentry, mode);
-	if (err)
+	if (err) {
+		if (added)
+			wrapfs_long_name_remove(dentry, lower_parent_dentry,
+						lower_path.mnt);
 		goto out;
+	}
 
 	err = wrapfs_interpose(dentry, dir->i_sb, &lower_path);
 	if (err)
 		goto out;
 
+	wrapfs_dir_changed(dir);
 	fsstack_copy_attr_times(dir, wrapfs_lower_inode(dir));
 	fsstack_copy_inode_size(dir, lower_parent_dentry->d_inode);
 	/* update number of links on parent directory */
@@ -229,7 +265,6 @@ out:
 	mnt_drop_write(lower_path.mnt);
 out_unlock:
 	unlock_dir(lower_parent_dentry);
-	wrapfs_put_lower_path(dentry, &lower_path);
 #ifdef EXTRA_CREDIT
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		DBGRET(err);
@@ -247,20 +282,25 @@ static int wrapfs_rmdir(struct inode *dir, struct dentry *dentry)
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
-	wrapfs_get_lower_path(dentry, &lower_path);
+	wrapfs_borrow_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	lower_dir_dentry = lock_parent(lower_dentry);
 
 	err = mnt_want_write(lower_path.mnt);
 	if (err)
 		goto out_unlock;
+	err = wrapfs_long_name_index_remove(dir->i_sb, &lower_path);
+	if (err)
+		goto out;
 	err = vfs_rmdir(lower_dir_dentry->d_inode, lower_dentry);
 	if (err)
 		goto out;
+	wrapfs_long_name_remove(dentry, lower_dir_dentry, lower_path.mnt);
 
 	d_drop(dentry);	/* drop our dentry on success (why not VFS's job?) */
 	if (dentry->d_inode)
 		clear_nlink(dentry->d_inode);
+	wrapfs_dir_changed(dir);
 	fsstack_copy_attr_times(dir, lower_dir_dentry->d_inode);
 	fsstack_copy_inode_size(dir, lower_dir_dentry->d_inode);
 	set_nlink(dir, lower_dir_dentry->d_inode->i_nlink);
@@ -269,7 +309,6 @@ out:
 	mnt_drop_write(lower_path.mnt);
 out_unlock:
 	unlock_dir(lower_dir_dentry);
-	wrapfs_put_lower_path(dentry, &lower_path);
 #ifdef EXTRA_CREDIT
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		DBGRET(err);
@@ -280,7 +319,7 @@ out_unlock:
 static int wrapfs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 			dev_t dev)
 {
-	int err = 0;
+	int err = 0, added;
 	struct dentry *lower_dentry;
 	struct dentry *lower_parent_dentry = NULL;
 	struct path lower_path;
@@ -288,20 +327,30 @@ static int wrapfs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
-	wrapfs_get_lower_path(dentry, &lower_path);
+	wrapfs_borrow_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	lower_parent_dentry = lock_parent(lower_dentry);
 
 	err = mnt_want_write(lower_path.mnt);
 	if (err)
 		goto out_unlock;
+	err = wrapfs_long_name_add(dentry, lower_parent_dentry,
+				   lower_path.mnt);
+	if (err < 0)
+		goto out;
+	added = err;
 	err = vfs_mknod(lower_parent_dentry->d_inode, lower_dentry, mode, dev);
-	if (err)
+	if (err) {
+		if (added)
+			wrapfs_long_name_remove(dentry, lower_parent_dentry,
+						lower_path.mnt);
 		goto out;
+	}
 
 	err = wrapfs_interpose(dentry, dir->i_sb, &lower_path);
 	if (err)
 		goto out;
+	wrapfs_dir_changed(dir);
 	fsstack_copy_attr_times(dir, wrapfs_lower_inode(dir));
 	fsstack_copy_inode_size(dir, lower_parent_dentry->d_inode);
 
@@ -309,7 +358,6 @@ out:
 	mnt_drop_write(lower_path.mnt);
 out_unlock:
 	unlock_dir(lower_parent_dentry);
-	wrapfs_put_lower_path(dentry, &lower_path);
 #ifdef EXTRA_CREDIT
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		DBGRET(err);
@@ -324,7 +372,7 @@ out_unlock:
 static int wrapfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 			 struct inode *new_dir, struct dentry *new_dentry)
 {
-	int err = 0;
+	int err = 0, added;
 	struct dentry *lower_old_dentry = NULL;
 	struct dentry *lower_new_dentry = NULL;
 	struct dentry *lower_old_dir_dentry = NULL;
@@ -335,8 +383,8 @@ static int wrapfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
-	wrapfs_get_lower_path(old_dentry, &lower_old_path);
-	wrapfs_get_lower_path(new_dentry, &lower_new_path);
+	wrapfs_borrow_lower_path(old_dentry, &lower_old_path);
+	wrapfs_borrow_lower_path(new_dentry, &lower_new_path);
 	lower_old_dentry = lower_old_path.dentry;
 	lower_new_dentry = lower_new_path.dentry;
 	lower_old_dir_dentry = dget_parent(lower_old_dentry);
@@ -361,11 +409,25 @@ static int wrapfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	if (err)
 		goto out_drop_old_write;
 
+	err = wrapfs_long_name_add(new_dentry, lower_new_dir_dentry,
+				   lower_new_path.mnt);
+	if (err < 0)
+		goto out_err;
+	added = err;
 	err = vfs_rename(lower_old_dir_dentry->d_inode, lower_old_dentry,
 			 lower_new_dir_dentry->d_inode, lower_new_dentry);
-	if (err)
+	if (err) {
+		if (added)
+			wrapfs_long_name_remove(new_dentry,
+						lower_new_dir_dentry,
+						lower_new_path.mnt);
 		goto out_err;
+	}
+	wrapfs_long_name_remove(old_dentry, lower_old_dir_dentry,
+				lower_old_path.mnt);
 
+	wrapfs_dir_changed(old_dir);
+	wrapfs_dir_changed(new_dir);
 	fsstack_copy_attr_all(new_dir, lower_new_dir_dentry->d_inode);
 	fsstack_copy_inode_size(new_dir, lower_new_dir_dentry->d_inode);
 	if (new_dir != old_dir) {
@@ -383,8 +445,6 @@ out:
 	unlock_rename(lower_old_dir_dentry, lower_new_dir_dentry);
 	dput(lower_old_dir_dentry);
 	dput(lower_new_dir_dentry);
-	wrapfs_put_lower_path(old_dentry, &lower_old_path);
-	wrapfs_put_lower_path(new_dentry, &lower_new_path);
 #ifdef EXTRA_CREDIT
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		DBGRET(err);
@@ -401,7 +461,7 @@ static int wrapfs_readlink(struct dentry *dentry, char __user *buf, int bufsiz)
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
-	wrapfs_get_lower_path(dentry, &lower_path);
+	wrapfs_borrow_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	if (!lower_dentry->d_inode->i_op ||
 	    !lower_dentry->d_inode->i_op->readlink) {
@@ -416,7 +476,6 @@ static int wrapfs_readlink(struct dentry *dentry, char __user *buf, int bufsiz)
 	fsstack_copy_attr_atime(dentry->d_inode, lower_dentry->d_inode);
 
 out:
-	wrapfs_put_lower_path(dentry, &lower_path);
 #ifdef EXTRA_CREDIT
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		DBGRET(err);
@@ -503,12 +562,40 @@ static int wrapfs_setattr(struct dentry *dentry, struct iattr *ia)
 	 */
 	err = inode_change_ok(inode, ia);
 	if (err)
-		goto out_err;
+		goto out;
 
-	wrapfs_get_lower_path(dentry, &lower_path);
+	wrapfs_borrow_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	lower_inode = wrapfs_lower_inode(inode);
 
+#ifdef WRAPFS_CRYPTO
+	/*
+	 * Growing a file whose data we encrypt: the partial pages at the
+	 * old and the new end of file need real ciphertext of zeros, or
+	 * they would not read back as zeros.  The rest becomes a hole.
+	 * Reading and writing back those pages needs the shared lower
+	 * file, which a file nobody has open (truncate by path) lacks:
+	 * hold it for the change, and the put writes the pages back.
+	 */
+	if ((ia->ia_valid & ATTR_SIZE) &&
+	    inode->i_fop == &wrapfs_main_fops_add_space &&
+	    wrapfs_has_key(inode->i_sb) &&
+	    ia->ia_size > i_size_read(inode)) {
+		err = inode_newsize_ok(inode, ia->ia_size);
+		if (err)
+			goto out;
+		err = wrapfs_get_lower_file(dentry, inode, FMODE_WRITE);
+		if (err)
+			goto out;
+		err = wrapfs_truncate(dentry, ia->ia_size,
+				      ia->ia_valid & ATTR_FILE ?
+				      ia->ia_file : NULL);
+		wrapfs_put_lower_file(inode);
+		if (err)
+			goto out;
+	}
+#endif
+
 	/* prepare our own lower struct iattr (with the lower file) */
 	memcpy(&lower_ia, ia, sizeof(lower_ia));
 	if (ia->ia_valid & ATTR_FILE)
@@ -557,8 +644,61 @@ static int wrapfs_setattr(struct dentry *dentry, struct iattr *ia)
 	 */
 
 out:
-	wrapfs_put_lower_path(dentry, &lower_path);
-out_err:
+#ifdef EXTRA_CREDIT
+	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
+		DBGRET(err);
+#endif
+	return err;
+}
+
+/*
+ * FIEMAP comes from the lower file: the extents of the ciphertext are
+ * those of the plaintext, at the same offsets.  What is on disk there is
+ * not the file's data, though, so with encryption every extent is
+ * flagged as encrypted.
+ */
+static int wrapfs_fiemap(struct inode *inode,
+			 struct fiemap_extent_info *fieinfo,
+			 u64 start, u64 len)
+{
+	int err;
+	struct inode *lower_inode = wrapfs_lower_inode(inode);
+#ifdef WRAPFS_CRYPTO
+	unsigned int i;
+#endif
+#ifdef EXTRA_CREDIT
+	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
+		UDBG;
+#endif
+	if (!lower_inode->i_op->fiemap) {
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+	/* ioctl_fiemap() has synced our pages; the lower ones are ours */
+	if (fieinfo->fi_flags & FIEMAP_FLAG_SYNC) {
+		err = filemap_write_and_wait(lower_inode->i_mapping);
+		if (err)
+			goto out;
+	}
+	err = lower_inode->i_op->fiemap(lower_inode, fieinfo, start, len);
+#ifdef WRAPFS_CRYPTO
+	if (err || inode->i_fop != &wrapfs_main_fops_add_space)
+		goto out;
+	for (i = 0; i < fieinfo->fi_extents_mapped &&
+		    i < fieinfo->fi_extents_max; i++) {
+		struct fiemap_extent __user *ext =
+			fieinfo->fi_extents_start + i;
+		u32 flags;
+
+		if (get_user(flags, &ext->fe_flags) ||
+		    put_user(flags | FIEMAP_EXTENT_DATA_ENCRYPTED |
+			     FIEMAP_EXTENT_ENCODED, &ext->fe_flags)) {
+			err = -EFAULT;
+			break;
+		}
+	}
+#endif
+out:
 #ifdef EXTRA_CREDIT
 	if (debug_opt & I_DOPS || debug_opt & ALL_DOPS)
 		DBGRET(err);
@@ -591,4 +731,5 @@ const struct inode_operations wrapfs_dir_iops = {
 const struct inode_operations wrapfs_main_iops = {
 	.permission	= wrapfs_permission,
 	.setattr	= wrapfs_setattr,
+	.fiemap		= wrapfs_fiemap,
 };
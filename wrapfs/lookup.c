@@ -9,6 +9,11 @@
  * published by the Free Software Foundation.
  */
 
+#include <linux/cred.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <asm/unaligned.h>
+
 #include "wrapfs.h"
 
 /* The dentry cache is just so we have properly sized dentries */
@@ -26,16 +31,42 @@ int wrapfs_init_dentry_cache(void)
 
 void wrapfs_destroy_dentry_cache(void)
 {
+	/* wait for the frees queued by free_dentry_private_data */
+	rcu_barrier();
 	if (wrapfs_dentry_cachep)
 		kmem_cache_destroy(wrapfs_dentry_cachep);
 }
 
+static void wrapfs_free_dentry_info(struct rcu_head *head)
+{
+	kmem_cache_free(wrapfs_dentry_cachep,
+			container_of(head, struct wrapfs_dentry_info, rcu));
+}
+
+/* freed after a grace period: rcu-walk reads it without a reference */
 void free_dentry_private_data(struct dentry *dentry)
 {
+	struct wrapfs_dentry_info *info;
+
 	if (!dentry || !dentry->d_fsdata)
 		return;
-	kmem_cache_free(wrapfs_dentry_cachep, dentry->d_fsdata);
+	info = dentry->d_fsdata;
 	dentry->d_fsdata = NULL;
+	call_rcu(&info->rcu, wrapfs_free_dentry_info);
+}
+
+/*
+ * Pick @dentry's operations before it is hashed.  If the lower dentry
+ * never needs revalidating, neither do we, and leaving ->d_revalidate
+ * out keeps path walks through us in rcu-walk.  Without a lower dentry,
+ * assume the worst.
+ */
+void wrapfs_set_d_op(struct dentry *dentry, struct dentry *lower_dentry)
+{
+	if (lower_dentry && !(lower_dentry->d_flags & DCACHE_OP_REVALIDATE))
+		d_set_d_op(dentry, &wrapfs_dops_noreval);
+	else
+		d_set_d_op(dentry, &wrapfs_dops);
 }
 
 /* allocate new dentry private data */
@@ -172,6 +203,15 @@ int wrapfs_interpose(struct dentry *dentry, struct super_block *sb,
 		err = -EXDEV;
 		goto out;
 	}
+#ifdef WRAPFS_CRYPTO
+	/* its IV would share keystream with another file's */
+	if (WRAPFS_SB(sb)->crypt.mode->iv32 &&
+	    S_ISREG(lower_inode->i_mode) &&
+	    lower_inode->i_ino != (u32)lower_inode->i_ino) {
+		err = -EOVERFLOW;
+		goto out;
+	}
+#endif
 
 	/*
 	 * We allocate our new inode below by calling wrapfs_iget,
@@ -205,16 +245,30 @@ static struct dentry *__wrapfs_lookup(struct dentry *dentry, int flags,
 	struct dentry *lower_dir_dentry = NULL;
 	struct dentry *lower_dentry;
 	const char *name;
+	char *lower_name = NULL;
 	struct path lower_path;
 	struct qstr this;
 
-	/* must initialize dentry operations */
-	d_set_d_op(dentry, &wrapfs_dops);
-
 	if (IS_ROOT(dentry))
 		goto out;
 
 	name = dentry->d_name.name;
+#ifdef WRAPFS_CRYPTO
+	/* the lower file system only ever sees encrypted names */
+	if (wrapfs_encnames(dentry->d_sb)) {
+		lower_name = kmalloc(NAME_MAX + 1, GFP_KERNEL);
+		if (!lower_name) {
+			err = -ENOMEM;
+			goto out;
+		}
+		err = wrapfs_encrypt_name(dentry->d_sb, name,
+					  dentry->d_name.len, lower_name);
+		if (err < 0)
+			goto out;
+		err = 0;
+		name = lower_name;
+	}
+#endif
 
 	/* now start the actual lookup procedure */
 	lower_dir_dentry = lower_parent_path->dentry;
@@ -227,6 +281,7 @@ static struct dentry *__wrapfs_lookup(struct dentry *dentry, int flags,
 	/* no error: handle positive dentries */
 	if (!err) {
 		wrapfs_set_lower_path(dentry, &lower_path);
+		wrapfs_set_d_op(dentry, lower_path.dentry);
 		err = wrapfs_interpose(dentry, dentry->d_sb, &lower_path);
 		if (err) /* path_put underlying path on error */
 			wrapfs_put_reset_lower_path(dentry);
@@ -259,6 +314,7 @@ setup_lower:
 	lower_path.dentry = lower_dentry;
 	lower_path.mnt = mntget(lower_dir_mnt);
 	wrapfs_set_lower_path(dentry, &lower_path);
+	wrapfs_set_d_op(dentry, lower_dentry);
 
 	/*
 	 * If the intent is to create a file, then don't return an error, so
@@ -269,6 +325,10 @@ setup_lower:
 		err = 0;
 
 out:
+	/* ->d_release must still free our private data */
+	if (!dentry->d_op)
+		wrapfs_set_d_op(dentry, NULL);
+	kfree(lower_name);
 	return ERR_PTR(err);
 }
 
@@ -280,9 +340,10 @@ struct dentry *wrapfs_lookup(struct inode *dir, struct dentry *dentry,
 	int err = 0;
 
 	BUG_ON(!nd);
-	parent = dget_parent(dentry);
+	/* the VFS holds the directory's i_mutex: d_parent can't change */
+	parent = dentry->d_parent;
 
-	wrapfs_get_lower_path(parent, &lower_parent_path);
+	wrapfs_borrow_lower_path(parent, &lower_parent_path);
 
 	/* allocate dentry private data.  We free it in ->d_release */
 	err = new_dentry_private_data(dentry);
@@ -303,7 +364,582 @@ struct dentry *wrapfs_lookup(struct inode *dir, struct dentry *dentry,
 				wrapfs_lower_inode(parent->d_inode));
 
 out:
-	wrapfs_put_lower_path(parent, &lower_parent_path);
-	dput(parent);
 	return ret;
 }
+
+#ifdef WRAPFS_CRYPTO
+/*
+ * The long name index is a hash table on disk: a header block, then
+ * buckets of one block each, picked by the low bits of the digest, so
+ * adding or removing a name reads and writes one bucket.  A bucket that
+ * has no room left doubles the table: the records that move are copied
+ * to their new buckets and the header is written last, so a crash part
+ * way leaves the old table whole.  A record left behind by a move, like
+ * one cleared by a remove, counts as a free slot.
+ */
+#define WRAPFS_INDEX_BLOCK	4096
+#define WRAPFS_INDEX_BUCKET	\
+	(WRAPFS_INDEX_BLOCK / sizeof(struct wrapfs_long_name))
+#define WRAPFS_INDEX_MAGIC	0x6e6c7777	/* "wwln" */
+/* 4 GB of buckets, about 14 million names */
+#define WRAPFS_INDEX_BUCKETS_MAX	(1 << 20)
+
+struct wrapfs_index_header {
+	__le32 magic;
+	__le32 buckets;			/* a power of two */
+} __packed;
+
+/* an open index, and a buffer for one of its buckets */
+struct wrapfs_index {
+	struct file *file;
+	unsigned int buckets;
+	struct wrapfs_long_name *bucket;
+};
+
+/*
+ * The long name index is our metadata, not the caller's file: it is
+ * looked up, created and written as the mounter, who owns it and whose
+ * quota it counts against, so whoever may create a long name in a
+ * directory may also record it.
+ */
+static const struct cred *wrapfs_index_creds(struct super_block *sb)
+{
+	return override_creds(WRAPFS_SB(sb)->crypt.mounter_cred);
+}
+
+/* the index dentry of @lower_dir, whose i_mutex the caller holds */
+static struct dentry *wrapfs_index_lookup(struct dentry *lower_dir)
+{
+	return lookup_one_len(WRAPFS_LONG_NAME_INDEX, lower_dir,
+			      sizeof(WRAPFS_LONG_NAME_INDEX) - 1);
+}
+
+static loff_t wrapfs_index_pos(unsigned int bucket)
+{
+	return (loff_t)(bucket + 1) * WRAPFS_INDEX_BLOCK;
+}
+
+/* the digest is already as random as a hash gets */
+static unsigned int wrapfs_index_hash(const u8 *digest)
+{
+	return get_unaligned_le32(digest);
+}
+
+/* is @rec a record that belongs in @bucket of a table of @buckets? */
+static bool wrapfs_index_live(const struct wrapfs_long_name *rec,
+			      unsigned int bucket, unsigned int buckets)
+{
+	unsigned int len = le16_to_cpu(rec->len);
+
+	return len && !(len % 16) && len <= WRAPFS_NAME_CRYPT_MAX &&
+		(wrapfs_index_hash(rec->digest) & (buckets - 1)) == bucket;
+}
+
+/*
+ * Read or write @len bytes of the index at @pos.  What lies past the
+ * end of the file has never been written and reads as zeros.
+ */
+static int wrapfs_index_rw(struct file *file, void *buf, size_t len,
+			   loff_t pos, int write)
+{
+	mm_segment_t old_fs;
+	size_t done = 0;
+	ssize_t n = 0;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	while (done < len) {
+		if (write)
+			n = vfs_write(file, (const char __user *)buf + done,
+				      len - done, &pos);
+		else
+			n = vfs_read(file, (char __user *)buf + done,
+				     len - done, &pos);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	set_fs(old_fs);
+	if (n < 0)
+		return n;
+	if (done < len) {
+		if (write)
+			return -EIO;
+		memset(buf + done, 0, len - done);
+	}
+	return 0;
+}
+
+/*
+ * wrapfs_index_open
+ * @idx: receives the open index
+ * @lower_dir: the lower directory, locked
+ * @lower_mnt: its mount
+ * @flags: O_RDONLY or O_RDWR, and O_CREAT to create a missing index
+ *
+ * Returns 0, -ENOENT if there is no index to open, or another error.
+ */
+static int wrapfs_index_open(struct wrapfs_index *idx,
+			     struct dentry *lower_dir,
+			     struct vfsmount *lower_mnt, int flags)
+{
+	struct wrapfs_index_header hdr;
+	struct dentry *index;
+	loff_t size;
+	int err;
+
+	index = wrapfs_index_lookup(lower_dir);
+	if (IS_ERR(index))
+		return PTR_ERR(index);
+	err = -ENOENT;
+	if (!index->d_inode) {
+		if (!(flags & O_CREAT))
+			goto out_dput;
+		err = vfs_create(lower_dir->d_inode, index,
+				 S_IFREG | S_IRUSR | S_IWUSR, NULL);
+		if (err)
+			goto out_dput;
+	}
+	idx->file = dentry_open(dget(index), mntget(lower_mnt),
+				(flags & ~O_CREAT) | O_LARGEFILE,
+				current_cred());
+	if (IS_ERR(idx->file)) {
+		err = PTR_ERR(idx->file);
+		goto out_dput;
+	}
+	err = -ENOMEM;
+	idx->bucket = kmalloc(WRAPFS_INDEX_BLOCK, GFP_KERNEL);
+	if (!idx->bucket)
+		goto out_fput;
+
+	size = i_size_read(index->d_inode);
+	if (!size) {
+		/* new, or created by a crash before its header was in */
+		hdr.magic = cpu_to_le32(WRAPFS_INDEX_MAGIC);
+		hdr.buckets = cpu_to_le32(1);
+		err = 0;
+		if (flags & O_CREAT)
+			err = wrapfs_index_rw(idx->file, &hdr, sizeof(hdr),
+					      0, 1);
+	} else {
+		err = wrapfs_index_rw(idx->file, &hdr, sizeof(hdr), 0, 0);
+	}
+	if (err)
+		goto out_free;
+	idx->buckets = le32_to_cpu(hdr.buckets);
+	if (le32_to_cpu(hdr.magic) != WRAPFS_INDEX_MAGIC ||
+	    !is_power_of_2(idx->buckets) ||
+	    idx->buckets > WRAPFS_INDEX_BUCKETS_MAX ||
+	    (idx->buckets > 1 && size < wrapfs_index_pos(idx->buckets))) {
+		err = -EIO;
+		goto out_free;
+	}
+	dput(index);
+	return 0;
+
+out_free:
+	kfree(idx->bucket);
+out_fput:
+	fput(idx->file);
+out_dput:
+	dput(index);
+	return err;
+}
+
+static void wrapfs_index_close(struct wrapfs_index *idx)
+{
+	kfree(idx->bucket);
+	fput(idx->file);
+}
+
+static int wrapfs_index_read_bucket(struct wrapfs_index *idx,
+				    unsigned int bucket)
+{
+	return wrapfs_index_rw(idx->file, idx->bucket, WRAPFS_INDEX_BLOCK,
+			       wrapfs_index_pos(bucket), 0);
+}
+
+/*
+ * Read the bucket of @digest into idx->bucket and store its number in
+ * @bucket.  Returns the slot of the digest's record there, or -ENOENT.
+ */
+static int wrapfs_index_find(struct wrapfs_index *idx, const u8 *digest,
+			     unsigned int *bucket)
+{
+	unsigned int i;
+	int err;
+
+	*bucket = wrapfs_index_hash(digest) & (idx->buckets - 1);
+	err = wrapfs_index_read_bucket(idx, *bucket);
+	if (err)
+		return err;
+	for (i = 0; i < WRAPFS_INDEX_BUCKET; i++)
+		if (wrapfs_index_live(&idx->bucket[i], *bucket,
+				      idx->buckets) &&
+		    !memcmp(idx->bucket[i].digest, digest,
+			    WRAPFS_LONG_NAME_DIGEST))
+			return i;
+	return -ENOENT;
+}
+
+static int wrapfs_index_write_rec(struct wrapfs_index *idx,
+				  const struct wrapfs_long_name *rec,
+				  unsigned int bucket, unsigned int slot)
+{
+	return wrapfs_index_rw(idx->file, (void *)rec, sizeof(*rec),
+			       wrapfs_index_pos(bucket) + slot * sizeof(*rec),
+			       1);
+}
+
+/* double the number of buckets of @idx */
+static int wrapfs_index_grow(struct wrapfs_index *idx)
+{
+	unsigned int buckets = idx->buckets * 2;
+	struct wrapfs_index_header hdr;
+	struct wrapfs_long_name *moved;
+	unsigned int b, i, n;
+	int err;
+
+	if (buckets > WRAPFS_INDEX_BUCKETS_MAX)
+		return -EFBIG;
+	moved = kmalloc(WRAPFS_INDEX_BLOCK, GFP_KERNEL);
+	if (!moved)
+		return -ENOMEM;
+	for (b = 0; b < idx->buckets; b++) {
+		err = wrapfs_index_read_bucket(idx, b);
+		if (err)
+			goto out;
+		memset(moved, 0, WRAPFS_INDEX_BLOCK);
+		for (i = n = 0; i < WRAPFS_INDEX_BUCKET; i++)
+			if (wrapfs_index_live(&idx->bucket[i],
+					      b + idx->buckets, buckets))
+				moved[n++] = idx->bucket[i];
+		/* written even if empty, over whatever a crash left there */
+		err = wrapfs_index_rw(idx->file, moved, WRAPFS_INDEX_BLOCK,
+				      wrapfs_index_pos(b + idx->buckets), 1);
+		if (err)
+			goto out;
+	}
+	hdr.magic = cpu_to_le32(WRAPFS_INDEX_MAGIC);
+	hdr.buckets = cpu_to_le32(buckets);
+	err = wrapfs_index_rw(idx->file, &hdr, sizeof(hdr), 0, 1);
+	if (!err)
+		idx->buckets = buckets;
+out:
+	kfree(moved);
+	return err;
+}
+
+/* keep @rec, a copy of a live record, in @names */
+static int wrapfs_long_names_keep(struct wrapfs_long_names *names,
+				  const struct wrapfs_long_name *rec,
+				  unsigned int *room)
+{
+	struct wrapfs_long_name *recs;
+
+	if (names->nr == *room) {
+		recs = vmalloc(2 * *room * sizeof(*recs));
+		if (!recs)
+			return -ENOMEM;
+		memcpy(recs, names->recs, names->nr * sizeof(*recs));
+		vfree(names->recs);
+		names->recs = recs;
+		*room *= 2;
+	}
+	names->recs[names->nr++] = *rec;
+	return 0;
+}
+
+/* read the live records of an open index and hash them by digest */
+static struct wrapfs_long_names *wrapfs_index_read(struct wrapfs_index *idx)
+{
+	struct wrapfs_long_names *names;
+	const struct wrapfs_long_name *rec;
+	unsigned int b, i, slot, room = WRAPFS_INDEX_BUCKET;
+	int err = -ENOMEM;
+
+	names = kzalloc(sizeof(*names), GFP_KERNEL);
+	if (!names)
+		return ERR_PTR(err);
+	names->recs = vmalloc(room * sizeof(*names->recs));
+	if (!names->recs)
+		goto out_free;
+	for (b = 0; b < idx->buckets; b++) {
+		err = wrapfs_index_read_bucket(idx, b);
+		if (err)
+			goto out_free;
+		for (i = 0; i < WRAPFS_INDEX_BUCKET; i++) {
+			if (!wrapfs_index_live(&idx->bucket[i], b,
+					       idx->buckets))
+				continue;
+			err = wrapfs_long_names_keep(names, &idx->bucket[i],
+						     &room);
+			if (err)
+				goto out_free;
+		}
+	}
+
+	err = -ENOMEM;
+	names->mask = roundup_pow_of_two(2 * names->nr + 1) - 1;
+	names->slots = vzalloc((names->mask + 1) * sizeof(*names->slots));
+	if (!names->slots)
+		goto out_free;
+	for (i = 0; i < names->nr; i++) {
+		rec = &names->recs[i];
+		memcpy(&slot, rec->digest, sizeof(slot));
+		for (slot &= names->mask; names->slots[slot];
+		     slot = (slot + 1) & names->mask)
+			;
+		names->slots[slot] = rec;
+	}
+	return names;
+
+out_free:
+	wrapfs_long_names_free(names);
+	return ERR_PTR(err);
+}
+
+const struct wrapfs_long_name *wrapfs_long_names_find(
+	struct wrapfs_long_names *names, const u8 *digest)
+{
+	const struct wrapfs_long_name *rec;
+	unsigned int slot;
+
+	memcpy(&slot, digest, sizeof(slot));
+	for (slot &= names->mask; (rec = names->slots[slot]);
+	     slot = (slot + 1) & names->mask)
+		if (!memcmp(rec->digest, digest, WRAPFS_LONG_NAME_DIGEST))
+			return rec;
+	return NULL;
+}
+
+void wrapfs_long_names_free(struct wrapfs_long_names *names)
+{
+	if (!names)
+		return;
+	vfree(names->slots);
+	vfree(names->recs);
+	kfree(names);
+}
+
+/*
+ * wrapfs_long_names_load
+ * @sb: the wrapfs superblock
+ * @lower_dir: the lower directory, not locked
+ *
+ * Read the records of the long name index of @lower_dir, for readdir.
+ *
+ * Returns the records, NULL if the directory has no index, or an
+ * ERR_PTR.
+ */
+struct wrapfs_long_names *wrapfs_long_names_load(struct super_block *sb,
+						 struct path *lower_dir)
+{
+	struct inode *dir = lower_dir->dentry->d_inode;
+	struct wrapfs_long_names *names;
+	const struct cred *old_cred;
+	struct wrapfs_index idx;
+	int err;
+
+	old_cred = wrapfs_index_creds(sb);
+	/* no bucket may move under us */
+	mutex_lock(&dir->i_mutex);
+	err = wrapfs_index_open(&idx, lower_dir->dentry, lower_dir->mnt,
+				O_RDONLY);
+	if (!err) {
+		names = wrapfs_index_read(&idx);
+		wrapfs_index_close(&idx);
+	} else {
+		names = err == -ENOENT ? NULL : ERR_PTR(err);
+	}
+	mutex_unlock(&dir->i_mutex);
+	revert_creds(old_cred);
+	return names;
+}
+
+/*
+ * __wrapfs_long_name_add
+ * @dentry: the wrapfs dentry about to get a lower entry
+ * @lower_dir: its lower directory, locked
+ * @lower_mnt: the lower mount, which the caller holds write access to
+ *
+ * Record @dentry's long name in the index of @lower_dir, creating the
+ * index if need be, unless the record is already there.
+ *
+ * Returns 1 if the record is new, and the caller must remove it again
+ * if the lower entry can't be made; 0 if it was there; or an error.
+ */
+int __wrapfs_long_name_add(struct dentry *dentry, struct dentry *lower_dir,
+			   struct vfsmount *lower_mnt)
+{
+	struct wrapfs_long_name *rec;
+	const struct cred *old_cred;
+	struct wrapfs_index idx;
+	unsigned int bucket, i;
+	bool added = false;
+	int err;
+
+	rec = kzalloc(sizeof(*rec), GFP_KERNEL);
+	if (!rec)
+		return -ENOMEM;
+	err = wrapfs_encrypt_long_name(dentry->d_sb, dentry->d_name.name,
+				       dentry->d_name.len, rec);
+	if (err <= 0)
+		goto out_free;
+
+	old_cred = wrapfs_index_creds(dentry->d_sb);
+	/* we hold the directory's i_mutex: no other writer of the index */
+	err = wrapfs_index_open(&idx, lower_dir, lower_mnt,
+				O_RDWR | O_CREAT);
+	if (err)
+		goto out_creds;
+	err = wrapfs_index_find(&idx, rec->digest, &bucket);
+	while (err == -ENOENT) {
+		for (i = 0; i < WRAPFS_INDEX_BUCKET; i++)
+			if (!wrapfs_index_live(&idx.bucket[i], bucket,
+					       idx.buckets))
+				break;
+		if (i < WRAPFS_INDEX_BUCKET) {
+			err = wrapfs_index_write_rec(&idx, rec, bucket, i);
+			added = !err;
+			break;
+		}
+		err = wrapfs_index_grow(&idx);
+		if (!err)
+			err = wrapfs_index_find(&idx, rec->digest, &bucket);
+	}
+	if (err >= 0)
+		err = added;
+	wrapfs_index_close(&idx);
+out_creds:
+	revert_creds(old_cred);
+out_free:
+	kfree(rec);
+	return err;
+}
+
+/*
+ * __wrapfs_long_name_remove
+ * @dentry: the wrapfs dentry whose lower entry is gone, or was never made
+ * @lower_dir: the lower directory it was in, locked
+ * @lower_mnt: the lower mount, which the caller holds write access to
+ *
+ * Clear the record of @dentry's long name from the index of @lower_dir.
+ * The lower entry is gone either way; a record we fail to clear takes
+ * up a slot until the name is created and removed again.
+ */
+void __wrapfs_long_name_remove(struct dentry *dentry,
+			       struct dentry *lower_dir,
+			       struct vfsmount *lower_mnt)
+{
+	struct wrapfs_long_name *rec;
+	const struct cred *old_cred;
+	struct wrapfs_index idx;
+	unsigned int bucket;
+	int slot;
+
+	rec = kzalloc(sizeof(*rec), GFP_KERNEL);
+	if (!rec)
+		return;
+	if (wrapfs_encrypt_long_name(dentry->d_sb, dentry->d_name.name,
+				     dentry->d_name.len, rec) <= 0)
+		goto out_free;
+
+	old_cred = wrapfs_index_creds(dentry->d_sb);
+	if (wrapfs_index_open(&idx, lower_dir, lower_mnt, O_RDWR))
+		goto out_creds;
+	slot = wrapfs_index_find(&idx, rec->digest, &bucket);
+	if (slot >= 0) {
+		memset(rec, 0, sizeof(*rec));
+		wrapfs_index_write_rec(&idx, rec, bucket, slot);
+	}
+	wrapfs_index_close(&idx);
+out_creds:
+	revert_creds(old_cred);
+out_free:
+	kfree(rec);
+}
+
+struct wrapfs_index_count {
+	unsigned int added;
+	bool others;
+};
+
+/* filldir: stop at the first entry that is not ".", ".." or the index */
+static int wrapfs_index_count_fill(void *buf, const char *name, int namlen,
+				   loff_t offset, u64 ino,
+				   unsigned int d_type)
+{
+	struct wrapfs_index_count *count = buf;
+
+	count->added++;
+	if ((namlen == 1 && name[0] == '.') ||
+	    (namlen == 2 && name[0] == '.' && name[1] == '.') ||
+	    (namlen == sizeof(WRAPFS_LONG_NAME_INDEX) - 1 &&
+	     !memcmp(name, WRAPFS_LONG_NAME_INDEX, namlen)))
+		return 0;
+	count->others = true;
+	return -ENOTEMPTY;
+}
+
+/*
+ * __wrapfs_long_name_index_remove
+ * @sb: the wrapfs superblock
+ * @lower_path: a lower directory about to be removed; its parent is
+ *              locked
+ *
+ * An index would keep an otherwise empty lower directory from being
+ * removed.  Unlink it if it is the only entry left.
+ *
+ * Returns 0, or -ENOTEMPTY if the directory holds anything else.
+ */
+int __wrapfs_long_name_index_remove(struct super_block *sb,
+				    struct path *lower_path)
+{
+	struct inode *dir = lower_path->dentry->d_inode;
+	struct wrapfs_index_count count = { 0, false };
+	const struct cred *old_cred;
+	struct dentry *index;
+	struct file *file;
+	int err;
+
+	old_cred = wrapfs_index_creds(sb);
+	mutex_lock(&dir->i_mutex);
+	index = wrapfs_index_lookup(lower_path->dentry);
+	mutex_unlock(&dir->i_mutex);
+	if (IS_ERR(index)) {
+		err = PTR_ERR(index);
+		goto out;
+	}
+	err = 0;
+	if (!index->d_inode)
+		goto out_dput;
+
+	file = dentry_open(dget(lower_path->dentry), mntget(lower_path->mnt),
+			   O_RDONLY | O_DIRECTORY | O_LARGEFILE,
+			   current_cred());
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		goto out_dput;
+	}
+	do {
+		count.added = 0;
+		err = vfs_readdir(file, wrapfs_index_count_fill, &count);
+	} while (!err && !count.others && count.added);
+	fput(file);
+	if (count.others)
+		err = -ENOTEMPTY;
+	if (err)
+		goto out_dput;
+
+	mutex_lock(&dir->i_mutex);
+	if (index->d_inode && index->d_parent == lower_path->dentry)
+		err = vfs_unlink(dir, index);
+	mutex_unlock(&dir->i_mutex);
+out_dput:
+	dput(index);
+out:
+	revert_creds(old_cred);
+	return err;
+}
+#endif
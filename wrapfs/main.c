@@ -27,7 +27,8 @@ static int wrapfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	int err = 0;
 	struct super_block *lower_sb;
 	struct path lower_path;
-	char *dev_name = (char *) raw_data;
+	struct wrapfs_mount_data *data = raw_data;
+	const char *dev_name = data->dev_name;
 	struct inode *inode;
 
 	if (!dev_name) {
@@ -53,6 +54,15 @@ static int wrapfs_read_super(struct super_block *sb, void *raw_data, int silent)
 		err = -ENOMEM;
 		goto out_free;
 	}
+	WRAPFS_SB(sb)->nocache_lower = data->opts.nocache_lower;
+#ifdef WRAPFS_CRYPTO
+	err = wrapfs_crypt_init(sb, &data->opts);
+	if (err) {
+		kfree(WRAPFS_SB(sb));
+		sb->s_fs_info = NULL;
+		goto out_free;
+	}
+#endif
 
 	/* set the lower superblock field of upper superblock */
 	lower_sb = lower_path.dentry->d_sb;
@@ -61,6 +71,12 @@ static int wrapfs_read_super(struct super_block *sb, void *raw_data, int silent)
 
 	/* inherit maxbytes from lower file system */
 	sb->s_maxbytes = lower_sb->s_maxbytes;
+#ifdef WRAPFS_CRYPTO
+	/* no page index past 32 bits may reach the IV */
+	if (WRAPFS_SB(sb)->crypt.mode->iv32)
+		sb->s_maxbytes = min_t(loff_t, sb->s_maxbytes,
+				       (loff_t)1 << (32 + PAGE_CACHE_SHIFT));
+#endif
 
 	/*
 	 * Our c/m/atime granularity is 1 ns because we may stack on file
@@ -81,7 +97,7 @@ static int wrapfs_read_super(struct super_block *sb, void *raw_data, int silent)
 		err = -ENOMEM;
 		goto out_iput;
 	}
-	d_set_d_op(sb->s_root, &wrapfs_dops);
+	wrapfs_set_d_op(sb->s_root, lower_path.dentry);
 
 	/* link the upper and lower dentries */
 	sb->s_root->d_fsdata = NULL;
@@ -114,6 +130,9 @@ out_iput:
 out_sput:
 	/* drop refs we took earlier */
 	atomic_dec(&lower_sb->s_active);
+#ifdef WRAPFS_CRYPTO
+	wrapfs_crypt_destroy(sb);
+#endif
 	kfree(WRAPFS_SB(sb));
 	sb->s_fs_info = NULL;
 out_free:
@@ -131,6 +150,13 @@ enum	{
 		wrapfs_debug,
 #endif
 		wrapfs_mmap,
+		wrapfs_async,
+		wrapfs_nocache_lower,
+		wrapfs_bounce_pages,
+#ifdef WRAPFS_CRYPTO
+		wrapfs_cipher,
+		wrapfs_encnames,
+#endif
 		wrapfs_opt_err };
 
 static const match_table_t tokens = {
@@ -138,12 +164,22 @@ static const match_table_t tokens = {
 	{wrapfs_debug, "debug=%d"},
 #endif
 	{wrapfs_mmap, "mmap"},
+	{wrapfs_async, "async"},
+	{wrapfs_nocache_lower, "nocache_lower"},
+	{wrapfs_bounce_pages, "bounce_pages=%d"},
+#ifdef WRAPFS_CRYPTO
+	{wrapfs_cipher, "cipher=%s"},
+	{wrapfs_encnames, "encnames"},
+#endif
 	{wrapfs_opt_err, NULL}
 };
 static int
-parse_options(char *options)
+parse_options(char *options, struct wrapfs_mount_opts *opts)
 {
 	char *p;
+#ifdef WRAPFS_CRYPTO
+	char *name;
+#endif
 	substring_t args[MAX_OPT_ARGS];
 	int rc = 0;
 	int token;
@@ -163,6 +199,44 @@ parse_options(char *options)
 			wrapfs_mmap_opt = 1;
 			rc = 0;
 			break;
+		case wrapfs_async:
+			opts->async = true;
+			rc = 0;
+			break;
+		case wrapfs_nocache_lower:
+			opts->nocache_lower = true;
+			rc = 0;
+			break;
+		case wrapfs_bounce_pages:
+			rc = kstrtoint(args[0].from, 10,
+				       &opts->bounce_pages);
+			if (!rc && (opts->bounce_pages < 0 ||
+				    opts->bounce_pages >
+				    WRAPFS_MAX_BOUNCE_PAGES)) {
+				printk(KERN_ERR "wrapfs: bounce_pages must be "
+				       "at most %d\n", WRAPFS_MAX_BOUNCE_PAGES);
+				rc = -EINVAL;
+			}
+			break;
+#ifdef WRAPFS_CRYPTO
+		case wrapfs_cipher:
+			name = match_strdup(&args[0]);
+			if (!name) {
+				rc = -ENOMEM;
+				break;
+			}
+			rc = wrapfs_cipher_lookup(name);
+			kfree(name);
+			if (rc >= 0) {
+				opts->cipher = rc;
+				rc = 0;
+			}
+			break;
+		case wrapfs_encnames:
+			opts->encnames = true;
+			rc = 0;
+			break;
+#endif
 		case wrapfs_opt_err:
 		default:
 			printk(KERN_WARNING
@@ -170,18 +244,24 @@ parse_options(char *options)
 				   __func__, p);
 
 		} /* end switch */
+		if (rc)
+			break;
 	} /* end while */
 	return rc;
 }
 struct dentry *wrapfs_mount(struct file_system_type *fs_type, int flags,
 			    const char *dev_name, void *raw_data)
 {
-	void *lower_path_name = (void *) dev_name;
-	if (raw_data)
-		parse_options(raw_data);
+	struct wrapfs_mount_data data = { .dev_name = dev_name };
+	int err;
+
+	if (raw_data) {
+		err = parse_options(raw_data, &data.opts);
+		if (err)
+			return ERR_PTR(err);
+	}
 
-	return mount_nodev(fs_type, flags, lower_path_name,
-			   wrapfs_read_super);
+	return mount_nodev(fs_type, flags, &data, wrapfs_read_super);
 }
 
 static struct file_system_type wrapfs_fs_type = {
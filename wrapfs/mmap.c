@@ -11,82 +11,29 @@
 #include <linux/pagemap.h>
 #include <linux/highmem.h>
 #include <linux/writeback.h>
-#include <linux/crypto.h>
-#include <linux/scatterlist.h>
+#include <linux/blkdev.h>
+#include <linux/uio.h>
 
 #include "wrapfs.h"
 
-#ifdef WRAPFS_CRYPTO
-static const char *default_algo = "ctr(aes)";
 /*
- This function is used to encrypt or decrypt a page.
- src_page	: the given page with data
- dst_page	: the final page which is to be filled in
- key		: the encryption key
- key_len	: the length of the encryption key
- encrypt	: This is a flag whch determines whether the src_page needs
- to be encrypted or deprypted.
- 1: encrypt
- 0: decrypt
-
- returns 0 on success and appropriate negative error or failure
- */
-int
-decrypt_encrypt_page(struct page *src_page,
-					 struct page *dst_page,
-					 char *key,
-					 int key_len,
-					 int encrypt){
-	int ret = 0;
-	struct scatterlist src_sg, dst_sg;
-	struct crypto_blkcipher *tfm;
-	struct blkcipher_desc desc;
-#ifdef EXTRA_CREDIT
-	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
-		UDBG;
-#endif
-	sg_init_table(&src_sg, 1);
-	sg_init_table(&dst_sg, 1);
-
-	sg_set_page(&src_sg, src_page, PAGE_SIZE, 0);
-	sg_set_page(&dst_sg, dst_page, PAGE_SIZE, 0);
-
-	tfm = crypto_alloc_blkcipher(default_algo, 0, CRYPTO_ALG_ASYNC);
-
-	if (IS_ERR(tfm)) {
-		printk(KERN_ERR "failed to load transform for %s: %ld\n",
-			   default_algo,
-		       PTR_ERR(tfm));
-		ret = IS_ERR(tfm);
-		goto out;
-	}
-	desc.tfm = tfm;
-	desc.flags = 0;
-
-	ret = crypto_blkcipher_setkey(tfm, key, key_len);
-	if (ret) {
-		printk(KERN_ERR "setkey() failed flags=%x\n",
-			   crypto_blkcipher_get_flags(tfm));
-		goto out;
-	}
-	if (encrypt)
-		ret = crypto_blkcipher_encrypt(
-					&desc, &dst_sg, &src_sg, PAGE_SIZE);
-	else
-		ret = crypto_blkcipher_decrypt(
-					&desc, &dst_sg, &src_sg, PAGE_SIZE);
-	if (ret)
-		printk(KERN_INFO "Some error occured while encrypting.\n");
+ * With nocache_lower, drop the lower file's cached ciphertext for pages
+ * [@start, @end] once we have consumed or written it: our plaintext
+ * pages are then the only cached copy.  Dirty or busy lower pages stay.
+ */
+static void wrapfs_drop_lower_pages(struct inode *wrapfs_inode,
+				    pgoff_t start, pgoff_t end)
+{
+	struct inode *lower_inode = wrapfs_lower_inode(wrapfs_inode);
+	struct wrapfs_stats *st = &WRAPFS_SB(wrapfs_inode->i_sb)->stats;
+	unsigned long nr;
 
-out:
-	crypto_free_blkcipher(tfm);
-#ifdef EXTRA_CREDIT
-	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
-		DBGRET(ret);
-#endif
-	return ret;
+	if (!WRAPFS_SB(wrapfs_inode->i_sb)->nocache_lower)
+		return;
+	nr = invalidate_mapping_pages(lower_inode->i_mapping, start, end);
+	atomic_long_add(nr, &st->lower_dropped);
 }
-#endif
+
 /**This function is taken from ecryptfs with necessary changes
  * wrapfs_read_lower
  * @data: The read data is stored here by this function
@@ -96,12 +43,13 @@ out:
  * @wrapfs_inode: The wrapfs inode
  *
  * Read @size bytes of data at byte offset @offset from the lower
- * inode into memory location @data.
+ * inode into memory location @data, through the inode's shared lower
+ * file.
  *
  * Returns bytes read on success; 0 on EOF; less than zero on error
  */
 int wrapfs_read_lower(char *data, loff_t offset, size_t size,
-				struct inode *wrapfs_inode, struct file *file)
+				struct inode *wrapfs_inode)
 {
 	struct file *lower_file;
 	mm_segment_t fs_save;
@@ -110,15 +58,18 @@ int wrapfs_read_lower(char *data, loff_t offset, size_t size,
 	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
-	lower_file = wrapfs_lower_file(file);
+	lower_file = wrapfs_get_inode_lower_file(wrapfs_inode);
 	if (!lower_file)
 		return -EIO;
-	if (!(lower_file->f_mode & FMODE_READ))
-		lower_file->f_mode = lower_file->f_mode | FMODE_READ;
 	fs_save = get_fs();
 	set_fs(get_ds());
 	rc = vfs_read(lower_file, data, size, &offset);
 	set_fs(fs_save);
+	fput(lower_file);
+	if (rc > 0)
+		wrapfs_drop_lower_pages(wrapfs_inode,
+					(offset - rc) >> PAGE_CACHE_SHIFT,
+					(offset - 1) >> PAGE_CACHE_SHIFT);
 #ifdef EXTRA_CREDIT
 	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
 		DBGRET(rc);
@@ -126,6 +77,242 @@ int wrapfs_read_lower(char *data, loff_t offset, size_t size,
 	return rc;
 }
 
+#ifdef WRAPFS_CRYPTO
+/*
+ * Holes.  Whole pages that were never written are left as holes in the
+ * lower file, and read back as zeros there.  A page of ciphertext is
+ * never all zeros, so such a page reads back as a page of zeros here
+ * too, without going near the cipher.  That only works page by page:
+ * any page that holds data, or is short of EOF, is written in full up
+ * to EOF (see the EOF handling in wrapfs_write() and write_end), and a
+ * hole page that gets written to is marked Checked on the way in so
+ * that writeback writes all of it (see wrapfs_set_dirty_range()).
+ */
+static bool wrapfs_page_is_hole(struct page *page)
+{
+	void *virt = kmap_atomic(page, KM_USER0);
+	bool hole = !memchr_inv(virt, 0, PAGE_CACHE_SIZE);
+
+	kunmap_atomic(virt, KM_USER0);
+	return hole;
+}
+
+/*
+ * wrapfs_decrypt_holes
+ * @wrapfs_inode: The wrapfs inode
+ * @index: File page index of @src[0] and @dst[0]
+ * @src: Run of pages holding ciphertext read from the lower file
+ * @dst: Pages receiving the plaintext; may be @src to work in place
+ * @nr_pages: Number of pages in the run, at most WRAPFS_CRYPT_BATCH
+ * @nread: Bytes of lower file data read into the run
+ *
+ * Decrypt the pages of the run that hold data, with one crypto call
+ * per stretch between holes.  A full page of zeros is a hole: its
+ * @dst page comes out as zeros and, if it is a page cache page, is
+ * marked Checked.  Nothing past @nread is zeroed here.
+ *
+ * Returns zero on success; non-zero otherwise
+ */
+static int wrapfs_decrypt_holes(struct inode *wrapfs_inode, pgoff_t index,
+				struct page **src, struct page **dst,
+				unsigned int nr_pages, size_t nread)
+{
+	struct scatterlist src_sg[WRAPFS_CRYPT_BATCH];
+	struct scatterlist dst_sg[WRAPFS_CRYPT_BATCH];
+	unsigned int nr_full = min_t(size_t, nr_pages,
+				     nread >> PAGE_CACHE_SHIFT);
+	unsigned int nr_data = min_t(size_t, nr_pages,
+				     DIV_ROUND_UP(nread, PAGE_CACHE_SIZE));
+	unsigned int i = 0, run;
+	int rc = 0;
+
+	while (i < nr_data && !rc) {
+		if (i < nr_full && wrapfs_page_is_hole(src[i])) {
+			if (dst[i] != src[i])
+				clear_highpage(dst[i]);
+			if (dst[i]->mapping)
+				SetPageChecked(dst[i]);
+			i++;
+			continue;
+		}
+		sg_init_table(src_sg, nr_data - i);
+		sg_init_table(dst_sg, nr_data - i);
+		run = 0;
+		do {
+			sg_set_page(&src_sg[run], src[i + run],
+				    PAGE_CACHE_SIZE, 0);
+			sg_set_page(&dst_sg[run], dst[i + run],
+				    PAGE_CACHE_SIZE, 0);
+			run++;
+		} while (i + run < nr_data &&
+			 !(i + run < nr_full &&
+			   wrapfs_page_is_hole(src[i + run])));
+		rc = wrapfs_crypt_sg(wrapfs_inode, index + i,
+				     dst == src ? src_sg : dst_sg, src_sg,
+				     run, 0);
+		i += run;
+	}
+	return rc;
+}
+
+/*
+ * Can we read and write the lower file's pages straight in its page
+ * cache?  Only block-device filesystems are trusted to fill their pages
+ * without a struct file (network filesystems want one for credentials).
+ */
+static bool wrapfs_lower_pagecache_ok(struct inode *wrapfs_inode)
+{
+	struct inode *lower_inode = wrapfs_lower_inode(wrapfs_inode);
+	const struct address_space_operations *a_ops =
+		lower_inode->i_mapping->a_ops;
+
+	return (lower_inode->i_sb->s_type->fs_flags & FS_REQUIRES_DEV) &&
+		a_ops->readpage && a_ops->write_begin && a_ops->write_end;
+}
+
+/*
+ * wrapfs_decrypt_lower_mapping
+ * @wrapfs_inode: The wrapfs inode
+ * @pages: Run of consecutive locked page cache pages, pages[i] holding
+ *         index pages[0]->index + i
+ * @nr_pages: Number of pages in the run, at most WRAPFS_CRYPT_BATCH
+ *
+ * Read engine for lower filesystems that pass wrapfs_lower_pagecache_ok():
+ * bring the lower pages of the run up to date in the lower page cache
+ * (one readahead request for all of them) and decrypt each one straight
+ * into its upper page with one batched crypto call.  The ciphertext is
+ * never copied, and nothing runs under set_fs().  The pages are neither
+ * zeroed past EOF nor unlocked here.
+ *
+ * Returns the number of bytes of file data in the run; less than zero
+ * on error
+ */
+static ssize_t wrapfs_decrypt_lower_mapping(struct inode *wrapfs_inode,
+					    struct page **pages,
+					    unsigned int nr_pages)
+{
+	struct inode *lower_inode = wrapfs_lower_inode(wrapfs_inode);
+	struct address_space *lower_mapping = lower_inode->i_mapping;
+	struct page *lower_pages[WRAPFS_CRYPT_BATCH];
+	pgoff_t index = pages[0]->index;
+	loff_t start = (loff_t)index << PAGE_CACHE_SHIFT;
+	loff_t lower_size = i_size_read(lower_inode);
+	struct file *lower_file;
+	unsigned int i, nr_data;
+	ssize_t rc = 0;
+
+	if (start >= lower_size)
+		return 0;
+	nr_data = min_t(loff_t, nr_pages,
+			DIV_ROUND_UP(lower_size - start, PAGE_CACHE_SIZE));
+	lower_file = wrapfs_get_inode_lower_file(wrapfs_inode);
+	if (lower_file) {
+		page_cache_sync_readahead(lower_mapping, &lower_file->f_ra,
+					  lower_file, index, nr_data);
+		fput(lower_file);
+	}
+	for (i = 0; i < nr_data; i++) {
+		lower_pages[i] = read_mapping_page(lower_mapping, index + i,
+						   NULL);
+		if (IS_ERR(lower_pages[i])) {
+			rc = PTR_ERR(lower_pages[i]);
+			goto out;
+		}
+	}
+	rc = min_t(loff_t, lower_size - start,
+		   (loff_t)nr_data << PAGE_CACHE_SHIFT);
+	rc = wrapfs_decrypt_holes(wrapfs_inode, index, lower_pages, pages,
+				  nr_data, rc) ?: rc;
+out:
+	while (i--)
+		page_cache_release(lower_pages[i]);
+	if (rc > 0)
+		wrapfs_drop_lower_pages(wrapfs_inode, index,
+					index + nr_data - 1);
+	return rc;
+}
+
+/*
+ * wrapfs_encrypt_lower_mapping
+ * @wrapfs_inode: The wrapfs inode
+ * @pages: Run of consecutive page cache pages, pages[i] holding index
+ *         pages[0]->index + i
+ * @nr_pages: Number of pages in the run, at most WRAPFS_CRYPT_BATCH
+ * @from: Offset in the first page at which the data to write starts
+ * @to: Offset in the last page at which the data to write ends
+ *
+ * Write engine for lower filesystems that pass wrapfs_lower_pagecache_ok():
+ * take each lower page with the lower mapping's write_begin, encrypt the
+ * range straight into it and hand it back with write_end, so the lower
+ * filesystem's own writeback takes it from there.  No bounce page, no
+ * copy, and no vfs_write() on a shared struct file.  The lower i_mutex
+ * is held across the run, as a write(2) to the lower file would.
+ *
+ * Returns zero on success; non-zero otherwise
+ */
+static int wrapfs_encrypt_lower_mapping(struct inode *wrapfs_inode,
+					struct page **pages,
+					unsigned int nr_pages,
+					size_t from, size_t to)
+{
+	struct inode *lower_inode = wrapfs_lower_inode(wrapfs_inode);
+	struct address_space *lower_mapping = lower_inode->i_mapping;
+	unsigned int ctr_block =
+		WRAPFS_SB(wrapfs_inode->i_sb)->crypt.mode->ctr_block;
+	struct file *lower_file;
+	unsigned int i;
+	int rc = 0;
+
+	/*
+	 * The cipher can only start at a counter block (or, for modes that
+	 * can't seek, at the page).  The clean bytes in front encrypt to
+	 * what the lower page already holds, but write_begin must still
+	 * bring them in, so widen the write to match.
+	 */
+	from = ctr_block ? from - from % ctr_block : 0;
+	lower_file = wrapfs_get_inode_lower_file(wrapfs_inode);
+	if (!lower_file)
+		return -EIO;
+	mutex_lock(&lower_inode->i_mutex);
+	for (i = 0; i < nr_pages; i++) {
+		size_t start = i ? 0 : from;
+		size_t end = (i == nr_pages - 1) ? to : PAGE_CACHE_SIZE;
+		loff_t pos = ((loff_t)pages[i]->index << PAGE_CACHE_SHIFT) +
+			     start;
+		struct page *lower_page;
+		void *fsdata;
+
+		rc = pagecache_write_begin(lower_file, lower_mapping, pos,
+					   end - start,
+					   AOP_FLAG_UNINTERRUPTIBLE,
+					   &lower_page, &fsdata);
+		if (rc)
+			break;
+		rc = wrapfs_crypt_page_range(wrapfs_inode, &pages[i],
+					     &lower_page, 1, start, end, 1);
+		flush_dcache_page(lower_page);
+		/* a failed encrypt copies nothing, so nothing gets dirtied */
+		rc = pagecache_write_end(lower_file, lower_mapping, pos,
+					 end - start, rc ? 0 : end - start,
+					 lower_page, fsdata) ?: rc;
+		if (rc < 0)
+			break;
+		if (rc != end - start) {
+			rc = -EIO;
+			break;
+		}
+		rc = 0;
+	}
+	if (i)
+		file_update_time(lower_file);
+	mutex_unlock(&lower_inode->i_mutex);
+	balance_dirty_pages_ratelimited_nr(lower_mapping, i);
+	fput(lower_file);
+	mark_inode_dirty_sync(wrapfs_inode);
+	return rc;
+}
+#endif
+
 /**This function is taken from ecryptfs with necessary changes
  * wrapfs_read_lower_page_segment
  * @page_for_lower: The page into which data for wrapfs will be
@@ -134,7 +321,6 @@ int wrapfs_read_lower(char *data, loff_t offset, size_t size,
  *                  writing
  * @size: The number of bytes to write into @page_for_lower
  * @wrapfs_inode: The wrapfs inode
- * @file	: This file pointer corresponding to the page
  * Determines the byte offset in the file for the given page and
  * offset within the page, maps the page, and makes the call to read
  * the contents of @page_for_lower from the lower inode.
@@ -145,13 +331,12 @@ int wrapfs_read_lower_page_segment(struct page *page_for_lower,
 						 pgoff_t page_index,
 						 size_t offset_in_page,
 						 size_t size,
-						 struct inode *wrapfs_inode,
-						 struct file *file)
+						 struct inode *wrapfs_inode)
 {
 	char *virt;
 	loff_t offset;
+	size_t nread;
 	int rc = 0;
-	struct page *dst_page = NULL;
 
 	offset = ((((loff_t)page_index) << PAGE_CACHE_SHIFT) + offset_in_page);
 #ifdef EXTRA_CREDIT
@@ -159,44 +344,45 @@ int wrapfs_read_lower_page_segment(struct page *page_for_lower,
 		UDBG;
 #endif
 #ifdef WRAPFS_CRYPTO
-	if (strlen(WRAPFS_SB(page_for_lower->mapping->host->i_sb)->key) != 0) {
-		dst_page = alloc_page(GFP_USER);
-		if (!dst_page) {
-			rc = -ENOMEM;
-			printk(KERN_ERR "Error allocating memory for "
-				   "page\n");
-			goto out;
-		}
-		virt = kmap(dst_page);
-		rc = wrapfs_read_lower(virt, offset, size, wrapfs_inode, file);
-		rc = decrypt_encrypt_page(dst_page, page_for_lower,
-			WRAPFS_SB(page_for_lower->mapping->host->i_sb)->key,
-		sizeof(WRAPFS_SB(page_for_lower->mapping->host->i_sb)->key)-1,
-			0);
-	} else {
+	if (!wrapfs_has_key(wrapfs_inode->i_sb)) {
 		printk(KERN_ERR "key Not Set\n");
 		rc = -EPERM;
 		goto out;
+	}
+	if (!offset_in_page && size == PAGE_CACHE_SIZE &&
+	    wrapfs_lower_pagecache_ok(wrapfs_inode)) {
+		rc = wrapfs_decrypt_lower_mapping(wrapfs_inode,
+						  &page_for_lower, 1);
+		if (rc < 0)
+			goto out;
+		nread = rc;
+		goto out_zero;
+	}
 #endif
-		virt = kmap(page_for_lower);
-		rc = wrapfs_read_lower(virt, offset, size, wrapfs_inode, file);
+	/* read straight into the page cache page, ciphertext or not */
+	virt = kmap(page_for_lower);
+	rc = wrapfs_read_lower(virt + offset_in_page, offset, size,
+			       wrapfs_inode);
+	kunmap(page_for_lower);
+	if (rc < 0)
+		goto out;
+	nread = rc;
 #ifdef WRAPFS_CRYPTO
-	}
+	/* CTR needs no separate output buffer: decrypt where we read */
+	rc = wrapfs_decrypt_holes(wrapfs_inode, page_index, &page_for_lower,
+				  &page_for_lower, 1, offset_in_page + nread);
+	if (rc)
+		goto out;
+out_zero:
 #endif
-	if (rc > 0)
-		rc = 0;
-
-	if (dst_page) {
-		kunmap(dst_page);
-		__free_page(dst_page);
-	} else {
-		kunmap(page_for_lower);
-	}
+	/* past EOF: zero after decrypting, or we'd expose keystream */
+	if (nread < size)
+		zero_user(page_for_lower, offset_in_page + nread,
+			  size - nread);
+	rc = 0;
 
 	flush_dcache_page(page_for_lower);
-#ifdef WRAPFS_CRYPTO
 out:
-#endif
 #ifdef EXTRA_CREDIT
 	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
 		DBGRET(rc);
@@ -204,44 +390,35 @@ out:
 	return rc;
 }
 /**This function is taken from ecryptfs with necessary changes
- * wrapfs_write_lower
+ * wrapfs_writev_lower
  * @wrapfs_inode: The wrapfs inode
- * @data: Data to write
+ * @iov: Kernel buffers to write, in file order
+ * @nr_segs: Number of entries in @iov
  * @offset: Byte offset in the lower file to which to write the data
- * @size: Number of bytes from @data to write at @offset in the lower
- *        file
- * @file: The corresponding file pointer
- * Write data to the lower file.
+ * Write a run of kernel buffers to the lower file with one vfs_writev(),
+ * through the inode's shared lower file.
  *
  * Returns bytes written on success; less than zero on error
  */
-int wrapfs_write_lower(struct inode *wrapfs_inode, char *data,
-				loff_t offset, size_t size, struct file *file)
+int wrapfs_writev_lower(struct inode *wrapfs_inode, struct iovec *iov,
+			unsigned long nr_segs, loff_t offset)
 {
 	struct file *lower_file = NULL;
 	mm_segment_t fs_save;
 	ssize_t rc;
-	int append_enabled = 0;
 
-	lower_file = wrapfs_lower_file(file);
+	lower_file = wrapfs_get_inode_lower_file(wrapfs_inode);
 	if (!lower_file) {
 		printk(KERN_ERR "Could not find corresponsing lower file.");
 		return -EIO;
 	}
+	/* the shared lower file is never O_APPEND: @offset is honoured */
 	fs_save = get_fs();
 	set_fs(get_ds());
-
-	if (lower_file->f_flags & O_APPEND) {
-		append_enabled = 1;
-		lower_file->f_flags &= ~(O_APPEND);
-	}
-	rc = vfs_write(lower_file, data, size, &offset);
-
-	if (append_enabled) {
-		append_enabled = 0;
-		lower_file->f_flags |= O_APPEND;
-	}
+	rc = vfs_writev(lower_file, (const struct iovec __user *)iov,
+			nr_segs, &offset);
 	set_fs(fs_save);
+	fput(lower_file);
 	mark_inode_dirty_sync(wrapfs_inode);
 #ifdef EXTRA_CREDIT
 	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
@@ -250,71 +427,124 @@ int wrapfs_write_lower(struct inode *wrapfs_inode, char *data,
 	return rc;
 }
 /**This function is taken from ecryptfs with necessary changes
- * wrapfs_write_lower_page_segment
+ * wrapfs_write_lower
  * @wrapfs_inode: The wrapfs inode
- * @page_for_lower: The page containing the data to be written to the
- *                  lower file
- * @offset_in_page: The offset in the @page_for_lower from which to
- *                  start writing the data
- * @size: The amount of data from @page_for_lower to write to the
- *        lower file
- * @file: The corresponding file pointer
- * Determines the byte offset in the file for the given page and
- * offset within the page, maps the page, and makes the call to write
- * the contents of @page_for_lower to the lower inode.
+ * @data: Data to write
+ * @offset: Byte offset in the lower file to which to write the data
+ * @size: Number of bytes from @data to write at @offset in the lower
+ *        file
+ * Write data to the lower file.
+ *
+ * Returns bytes written on success; less than zero on error
+ */
+int wrapfs_write_lower(struct inode *wrapfs_inode, char *data,
+				loff_t offset, size_t size)
+{
+	struct iovec iov = { .iov_base = data, .iov_len = size };
+
+	return wrapfs_writev_lower(wrapfs_inode, &iov, 1, offset);
+}
+/*
+ * Write [@from of the first page, @to of the last page) of @data_pages,
+ * which hold what goes to the lower file, with one vfs_writev().  A
+ * short write is an error: the caller can't tell which part is missing.
+ */
+static int __wrapfs_write_lower_pages(struct inode *wrapfs_inode,
+				      struct page **data_pages,
+				      unsigned int nr_pages,
+				      loff_t offset, size_t from, size_t to)
+{
+	struct iovec iov[WRAPFS_CRYPT_BATCH];
+	size_t total = 0;
+	unsigned int i;
+	ssize_t rc;
+
+	for (i = 0; i < nr_pages; i++) {
+		size_t start = i ? 0 : from;
+		size_t end = (i == nr_pages - 1) ? to : PAGE_CACHE_SIZE;
+
+		iov[i].iov_base = (char *)kmap(data_pages[i]) + start;
+		iov[i].iov_len = end - start;
+		total += end - start;
+	}
+	rc = wrapfs_writev_lower(wrapfs_inode, iov, nr_pages, offset);
+	for (i = 0; i < nr_pages; i++)
+		kunmap(data_pages[i]);
+	if (rc >= 0 && rc < total)
+		rc = -EIO;
+	return rc < 0 ? rc : 0;
+}
+/**
+ * wrapfs_write_lower_pages
+ * @wrapfs_inode: The wrapfs inode
+ * @pages: Run of consecutive page cache pages, pages[i] holding index
+ *         pages[0]->index + i
+ * @nr_pages: Number of pages in the run, at most WRAPFS_CRYPT_BATCH
+ * @from: Offset in the first page at which the data to write starts
+ * @to: Offset in the last page at which the data to write ends
+ *
+ * Encrypts just that range of the run, at its counter offset, into
+ * bounce pages from the per-mount pool with one batched crypto call and
+ * writes the byte range [@from of the first
+ * page, @to of the last page) to the lower file with one vfs_writev().
+ * If the pool cannot hand out a page for every page of the run right
+ * away, the run is written in smaller pieces rather than waiting.
  *
  * Returns zero on success; non-zero otherwise
  */
-int wrapfs_write_lower_page_segment(struct inode *wrapfs_inode,
-						  struct page *page_for_lower,
-						  size_t offset_in_page,
-						  size_t size,
-						  struct file *file)
+int wrapfs_write_lower_pages(struct inode *wrapfs_inode,
+			     struct page **pages,
+			     unsigned int nr_pages,
+			     size_t from, size_t to)
 {
-	char *virt;
 	loff_t offset;
-	int rc;
-	struct page *dst_page = NULL;
+	int rc = 0;
+#ifdef WRAPFS_CRYPTO
+	struct page *bounce[WRAPFS_CRYPT_BATCH];
+	unsigned int nr_bounce;
+#endif
 #ifdef EXTRA_CREDIT
 	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
-	offset = ((((loff_t)page_for_lower->index) << PAGE_CACHE_SHIFT)
-			  + offset_in_page);
+	BUG_ON(!nr_pages || nr_pages > WRAPFS_CRYPT_BATCH);
+	offset = ((((loff_t)pages[0]->index) << PAGE_CACHE_SHIFT) + from);
 #ifdef WRAPFS_CRYPTO
-	if (strlen(WRAPFS_SB(page_for_lower->mapping->host->i_sb)->key) != 0) {
-		dst_page = alloc_page(GFP_USER);
-		if (!dst_page) {
-			rc = -ENOMEM;
-			printk(KERN_ERR "Error allocating memory for "
-				   "page\n");
-			goto out;
-		}
-		rc = decrypt_encrypt_page(page_for_lower, dst_page,
-			WRAPFS_SB(page_for_lower->mapping->host->i_sb)->key,
-		sizeof(WRAPFS_SB(page_for_lower->mapping->host->i_sb)->key)-1,
-			1);
-		virt = kmap(dst_page);
-	} else {
+	if (!wrapfs_has_key(wrapfs_inode->i_sb)) {
 		printk(KERN_ERR "key Not Set\n");
 		rc = -EPERM;
 		goto out;
-#endif
-		virt = kmap(page_for_lower);
-#ifdef WRAPFS_CRYPTO
 	}
-#endif
-	rc = wrapfs_write_lower(wrapfs_inode, virt, offset, size, file);
-	if (rc > 0)
-		rc = 0;
-	if (dst_page) {
-		kunmap(dst_page);
-		__free_page(dst_page);
-	} else {
-		kunmap(page_for_lower);
+	if (wrapfs_lower_pagecache_ok(wrapfs_inode)) {
+		rc = wrapfs_encrypt_lower_mapping(wrapfs_inode, pages,
+						  nr_pages, from, to);
+		goto out;
+	}
+	while (nr_pages) {
+		size_t end;
+
+		nr_bounce = wrapfs_get_bounce_pages(wrapfs_inode->i_sb,
+						    bounce, nr_pages);
+		end = (nr_bounce == nr_pages) ? to : PAGE_CACHE_SIZE;
+		rc = wrapfs_crypt_page_range(wrapfs_inode, pages, bounce,
+					     nr_bounce, from, end, 1);
+		if (!rc)
+			rc = __wrapfs_write_lower_pages(wrapfs_inode, bounce,
+							nr_bounce, offset,
+							from, end);
+		wrapfs_put_bounce_pages(wrapfs_inode->i_sb, bounce,
+					nr_bounce);
+		if (rc)
+			break;
+		offset += (loff_t)nr_bounce * PAGE_CACHE_SIZE - from;
+		pages += nr_bounce;
+		nr_pages -= nr_bounce;
+		from = 0;
 	}
-#ifdef WRAPFS_CRYPTO
 out:
+#else
+	rc = __wrapfs_write_lower_pages(wrapfs_inode, pages, nr_pages,
+					offset, from, to);
 #endif
 #ifdef EXTRA_CREDIT
 	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
@@ -322,14 +552,181 @@ out:
 #endif
 	return rc;
 }
+/*
+ * The part of a dirty page that differs from the lower file, [from, to),
+ * is kept in page_private so writeback encrypts and writes only that.
+ * A dirty page without PagePrivate is dirty all over.  All of these
+ * need the page locked.
+ */
+#define WRAPFS_DIRTY_SHIFT	16
+
+static void wrapfs_set_dirty_range(struct page *page, size_t from, size_t to)
+{
+	BUILD_BUG_ON(PAGE_CACHE_SHIFT > WRAPFS_DIRTY_SHIFT);
+	/* a hole in the lower file is filled a whole page at a time */
+	if (PageChecked(page)) {
+		ClearPageChecked(page);
+		from = 0;
+		to = PAGE_CACHE_SIZE;
+	}
+	if (PagePrivate(page)) {
+		unsigned long range = page_private(page);
+
+		from = min_t(size_t, from, range >> WRAPFS_DIRTY_SHIFT);
+		to = max_t(size_t, to,
+			   (range & ((1UL << WRAPFS_DIRTY_SHIFT) - 1)) + 1);
+	} else if (PageDirty(page)) {
+		return;
+	}
+	set_page_private(page, (from << WRAPFS_DIRTY_SHIFT) | (to - 1));
+	SetPagePrivate(page);
+}
+
+static void wrapfs_clear_dirty_range(struct page *page)
+{
+	ClearPagePrivate(page);
+	set_page_private(page, 0);
+}
+
+/* take @page's dirty range, leaving it clean as far as we know */
+static void wrapfs_take_dirty_range(struct page *page, size_t *from,
+				    size_t *to)
+{
+	unsigned long range = page_private(page);
+
+	if (!PagePrivate(page)) {
+		*from = 0;
+		*to = PAGE_CACHE_SIZE;
+		return;
+	}
+	*from = range >> WRAPFS_DIRTY_SHIFT;
+	*to = (range & ((1UL << WRAPFS_DIRTY_SHIFT) - 1)) + 1;
+	wrapfs_clear_dirty_range(page);
+}
+
+/*
+ * A run of consecutive dirty pages gathered by writeback, all under
+ * writeback and unlocked, to be encrypted and written in one go.
+ */
+struct wrapfs_wb_run {
+	struct page *pages[WRAPFS_CRYPT_BATCH];
+	unsigned int nr_pages;
+	size_t from;		/* dirty range start in the first page */
+	size_t to;		/* dirty range end in the last page */
+	/* pages written to the lower file so far, if wrote_any */
+	pgoff_t wrote_start, wrote_end;
+	bool wrote_any;
+};
+
+/* encrypt and write out @run, then end writeback on its pages */
+static int wrapfs_wb_flush(struct inode *inode, struct wrapfs_wb_run *run)
+{
+	unsigned int i;
+	int rc;
+
+	if (!run->nr_pages)
+		return 0;
+	rc = wrapfs_write_lower_pages(inode, run->pages, run->nr_pages,
+				      run->from, run->to);
+	if (rc) {
+		printk(KERN_WARNING "Error encrypting "
+				"page (upper index [0x%.16lx]); rc = [%d]\n",
+				run->pages[0]->index, rc);
+	} else {
+		pgoff_t last = run->pages[run->nr_pages - 1]->index;
+
+		if (!run->wrote_any || run->pages[0]->index < run->wrote_start)
+			run->wrote_start = run->pages[0]->index;
+		if (!run->wrote_any || last > run->wrote_end)
+			run->wrote_end = last;
+		run->wrote_any = true;
+	}
+	for (i = 0; i < run->nr_pages; i++) {
+		struct page *page = run->pages[i];
+
+		if (rc) {
+			SetPageError(page);
+			mapping_set_error(page->mapping, rc);
+		}
+		end_page_writeback(page);
+		page_cache_release(page);
+	}
+	run->nr_pages = 0;
+	return rc;
+}
+
+/*
+ * All runs are written: with nocache_lower, push the lower file's dirty
+ * ciphertext to disk and drop it from the lower page cache.
+ */
+static void wrapfs_wb_done(struct inode *inode, struct wrapfs_wb_run *run)
+{
+	struct inode *lower_inode = wrapfs_lower_inode(inode);
+	loff_t start = (loff_t)run->wrote_start << PAGE_CACHE_SHIFT;
+	loff_t end = ((loff_t)(run->wrote_end + 1) << PAGE_CACHE_SHIFT) - 1;
+
+	if (!WRAPFS_SB(inode->i_sb)->nocache_lower || !run->wrote_any)
+		return;
+	filemap_write_and_wait_range(lower_inode->i_mapping, start, end);
+	wrapfs_drop_lower_pages(inode, run->wrote_start, run->wrote_end);
+}
+
+/*
+ * Add the dirty range of the locked @page to @data's run, writing the
+ * run out first if @page cannot extend it: a run only continues across
+ * page boundaries that are dirty on both sides.  Nothing at or past
+ * i_size goes to the lower file, so the lower size tracks ours.
+ */
+static int wrapfs_wb_add_page(struct page *page,
+			      struct writeback_control *wbc, void *data)
+{
+	struct wrapfs_wb_run *run = data;
+	struct inode *inode = page->mapping->host;
+	loff_t i_size = i_size_read(inode);
+	pgoff_t end_index = i_size >> PAGE_CACHE_SHIFT;
+	size_t from, to;
+	int rc = 0;
+
+	wrapfs_take_dirty_range(page, &from, &to);
+	if (page->index > end_index)
+		to = 0;
+	else if (page->index == end_index)
+		to = min_t(size_t, to, i_size & ~PAGE_CACHE_MASK);
+	if (from >= to) {
+		/* truncated away while dirty: nothing left to write */
+		unlock_page(page);
+		return 0;
+	}
+
+	if (run->nr_pages &&
+	    (run->nr_pages == WRAPFS_CRYPT_BATCH ||
+	     run->to != PAGE_CACHE_SIZE || from ||
+	     run->pages[run->nr_pages - 1]->index + 1 != page->index))
+		rc = wrapfs_wb_flush(inode, run);
+
+	page_cache_get(page);
+	set_page_writeback(page);
+	unlock_page(page);
+	if (!run->nr_pages)
+		run->from = from;
+	run->pages[run->nr_pages++] = page;
+	run->to = to;
+	return rc;
+}
+
 /**This function is taken from ecryptfs with necessary changes
  * wrapfs_writepage
  * @page: Page that is locked before this call is made
  *
+ * Encrypts the page and writes it to the lower file.  Writes normally
+ * come through wrapfs_writepages(); this is what reclaim and page
+ * migration use.
+ *
  * Returns zero on success; non-zero otherwise
  */
 static int wrapfs_writepage(struct page *page, struct writeback_control *wbc)
 {
+	struct wrapfs_wb_run run = { .nr_pages = 0 };
 	int rc = 0;
 #ifdef EXTRA_CREDIT
 	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
@@ -343,65 +740,349 @@ static int wrapfs_writepage(struct page *page, struct writeback_control *wbc)
 	 */
 	if (current->flags & PF_MEMALLOC) {
 		redirty_page_for_writepage(wbc, page);
-		rc = 0;
+		unlock_page(page);
 		goto out;
 	}
-	/*
-	 here we need to write some code that copises the page to the lower.
-	 */
-	if (rc) {
-		printk(KERN_WARNING "Error encrypting "
-				"page (upper index [0x%.16lx])\n", page->index);
+	wrapfs_wb_add_page(page, wbc, &run);
+	rc = wrapfs_wb_flush(page->mapping->host, &run);
+	wrapfs_wb_done(page->mapping->host, &run);
+out:
+#ifdef EXTRA_CREDIT
+	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
+		DBGRET(rc);
+#endif
+	return rc;
+}
+/*
+ * wrapfs_writepages
+ * @mapping: The wrapfs inode mapping
+ * @wbc: What to write, and how hard to try
+ *
+ * Writes happen here rather than in ->write_end: dirty pages sit in the
+ * page cache as plaintext until writeback, which gathers consecutive
+ * ones into runs of up to WRAPFS_CRYPT_BATCH pages and encrypts and
+ * writes each run with one batched crypto call and one vfs_writev().
+ *
+ * Returns zero on success; non-zero otherwise
+ */
+static int wrapfs_writepages(struct address_space *mapping,
+			     struct writeback_control *wbc)
+{
+	struct wrapfs_wb_run run = { .nr_pages = 0 };
+	int rc, flush_rc;
+#ifdef EXTRA_CREDIT
+	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
+		UDBG;
+#endif
+	rc = write_cache_pages(mapping, wbc, wrapfs_wb_add_page, &run);
+	flush_rc = wrapfs_wb_flush(mapping->host, &run);
+	if (!rc)
+		rc = flush_rc;
+	wrapfs_wb_done(mapping->host, &run);
+#ifdef EXTRA_CREDIT
+	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
+		DBGRET(rc);
+#endif
+	return rc;
+}
+#ifdef WRAPFS_CRYPTO
+/* Completion of an async in-place page decrypt; @data is the page. */
+static void wrapfs_end_async_read(void *data, int err)
+{
+	struct page *page = data;
+
+	if (err) {
+		printk(KERN_ERR "Error decrypting page; "
+						"ret = [%d]\n", err);
+		ClearPageUptodate(page);
+		SetPageError(page);
+	} else {
+		flush_dcache_page(page);
+		SetPageUptodate(page);
+	}
+	unlock_page(page);
+}
+
+/*
+ * wrapfs_readpage_async
+ * @file: A file
+ * @page: Locked page from wrapfs inode mapping to fill
+ *
+ * Read the ciphertext from the lower file straight into @page and queue
+ * its in-place decryption on the async transform.  The page is marked
+ * up to date and unlocked by the completion callback, so the caller
+ * (usually readahead) can go on to read the next page while this one is
+ * being decrypted.  A short page at EOF, or a page for which no async
+ * request can be made, is decrypted right here instead.
+ *
+ * The page is always unlocked, now or later.  Returns zero on success;
+ * non-zero if the page could not be read.
+ */
+static int wrapfs_readpage_async(struct file *file, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	loff_t offset = ((loff_t)page->index) << PAGE_CACHE_SHIFT;
+	char *virt;
+	int rc;
+
+	if (!wrapfs_has_key(inode->i_sb)) {
+		printk(KERN_ERR "key Not Set\n");
+		rc = -EPERM;
+		goto out_err;
+	}
+	virt = kmap(page);
+	rc = wrapfs_read_lower(virt, offset, PAGE_CACHE_SIZE, inode);
+	kunmap(page);
+	if (rc < 0)
+		goto out_err;
+
+	if (rc == PAGE_CACHE_SIZE && !wrapfs_page_is_hole(page)) {
+		rc = wrapfs_crypt_page_async(inode, page, page, 0,
+					     wrapfs_end_async_read, page);
+		if (rc != -EAGAIN)
+			return rc;
+		rc = decrypt_encrypt_page(inode, page, page, 0);
+	} else {
+		size_t nread = rc;
+
+		rc = wrapfs_decrypt_holes(inode, page->index, &page, &page,
+					  1, nread);
+		if (!rc)
+			zero_user(page, nread, PAGE_CACHE_SIZE - nread);
+	}
+	wrapfs_end_async_read(page, rc);
+	return rc;
+
+out_err:
+	ClearPageUptodate(page);
+	unlock_page(page);
+	return rc;
+}
+#endif
+/**This function is taken from ecryptfs with necessary changes
+ * wrapfs_readpage
+ * @file: A file
+ * @page: Page from wrapfs inode mapping into which to stick the read data
+ *
+ * Read in a page, decrypting if necessary.
+ *
+ * Returns zero on success; non-zero on error.
+ */
+static int wrapfs_readpage(struct file *file, struct page *page)
+{
+	int ret = 0;
+#ifdef EXTRA_CREDIT
+	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
+		UDBG;
+#endif
+#ifdef WRAPFS_CRYPTO
+	if (WRAPFS_SB(page->mapping->host->i_sb)->crypt.async) {
+		/* the page gets unlocked from the completion */
+		ret = wrapfs_readpage_async(file, page);
+		goto out_async;
+	}
+#endif
+	ret = wrapfs_read_lower_page_segment(
+					page, page->index, 0,
+					PAGE_CACHE_SIZE, page->mapping->host);
+	if (ret) {
+		printk(KERN_ERR "Error decrypting page; "
+						"ret = [%d]\n", ret);
+		goto out;
+	}
+out:
+	if (ret)
 		ClearPageUptodate(page);
+	else
+		SetPageUptodate(page);
+	printk(KERN_DEBUG "Unlocking page with index = [0x%.16lx]\n",
+					page->index);
+	unlock_page(page);
+#ifdef WRAPFS_CRYPTO
+out_async:
+#endif
+#ifdef EXTRA_CREDIT
+	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
+		DBGRET(ret);
+#endif
+	return ret;
+}
+/*
+ * wrapfs_read_lower_pages
+ * @wrapfs_inode: The wrapfs inode
+ * @pages: Run of consecutive locked page cache pages, pages[i] holding
+ *         index pages[0]->index + i
+ * @nr_pages: Number of pages in the run, at most WRAPFS_CRYPT_BATCH
+ *
+ * Read the ciphertext of the whole run with one vfs_readv() on the
+ * shared lower file straight into the pages, decrypt them in place with
+ * one batched crypto call and zero whatever lies past EOF.  With the
+ * async option, full pages are queued on the async transform instead.
+ * Block-device lower filesystems skip the copy: the run is decrypted
+ * straight out of the lower page cache.
+ *
+ * Every page is unlocked, now or from the completion, and the caller's
+ * reference on it is dropped.
+ */
+static void wrapfs_read_lower_pages(struct inode *wrapfs_inode,
+				    struct page **pages,
+				    unsigned int nr_pages)
+{
+	struct iovec iov[WRAPFS_CRYPT_BATCH];
+	struct file *lower_file;
+	loff_t offset = ((loff_t)pages[0]->index) << PAGE_CACHE_SHIFT;
+	mm_segment_t fs_save;
+	unsigned int i;
+	size_t nread = 0;
+	ssize_t rc;
+#ifdef WRAPFS_CRYPTO
+	unsigned int nr_data, nr_done = 0;
+
+	if (!wrapfs_has_key(wrapfs_inode->i_sb)) {
+		printk(KERN_ERR "key Not Set\n");
+		rc = -EPERM;
+		goto out;
+	}
+	/* async decryption wants the ciphertext in the pages themselves */
+	if (!WRAPFS_SB(wrapfs_inode->i_sb)->crypt.async &&
+	    wrapfs_lower_pagecache_ok(wrapfs_inode)) {
+		rc = wrapfs_decrypt_lower_mapping(wrapfs_inode, pages,
+						  nr_pages);
+		if (rc >= 0) {
+			nread = rc;
+			rc = 0;
+		}
+		goto out;
+	}
+#endif
+	lower_file = wrapfs_get_inode_lower_file(wrapfs_inode);
+	if (!lower_file) {
+		rc = -EIO;
+		goto out;
+	}
+	for (i = 0; i < nr_pages; i++) {
+		iov[i].iov_base = kmap(pages[i]);
+		iov[i].iov_len = PAGE_CACHE_SIZE;
+	}
+	fs_save = get_fs();
+	set_fs(get_ds());
+	rc = vfs_readv(lower_file, (const struct iovec __user *)iov,
+		       nr_pages, &offset);
+	set_fs(fs_save);
+	for (i = 0; i < nr_pages; i++)
+		kunmap(pages[i]);
+	fput(lower_file);
+	if (rc < 0)
 		goto out;
+	if (rc > 0)
+		wrapfs_drop_lower_pages(wrapfs_inode, pages[0]->index,
+					(offset - 1) >> PAGE_CACHE_SHIFT);
+
+	nread = rc;
+	rc = 0;
+#ifdef WRAPFS_CRYPTO
+	nr_data = DIV_ROUND_UP(nread, PAGE_CACHE_SIZE);
+	if (WRAPFS_SB(wrapfs_inode->i_sb)->crypt.async) {
+		/* the completion unlocks; the page cache keeps the page */
+		for (; nr_done < nread >> PAGE_CACHE_SHIFT; nr_done++) {
+			struct page *page = pages[nr_done];
+
+			if (wrapfs_page_is_hole(page))
+				break;
+			page_cache_release(page);
+			rc = wrapfs_crypt_page_async(wrapfs_inode, page, page,
+						     0, wrapfs_end_async_read,
+						     page);
+			if (rc == -EAGAIN) {
+				/* still locked, so still ours */
+				page_cache_get(page);
+				rc = 0;
+				break;
+			}
+		}
 	}
-	SetPageUptodate(page);
-out:
-	unlock_page(page);
-#ifdef EXTRA_CREDIT
-	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
-		DBGRET(rc);
+	if (nr_data > nr_done)
+		rc = wrapfs_decrypt_holes(wrapfs_inode,
+					  pages[nr_done]->index,
+					  pages + nr_done, pages + nr_done,
+					  nr_data - nr_done,
+					  nread - ((size_t)nr_done <<
+						   PAGE_CACHE_SHIFT));
+	pages += nr_done;
+	nr_pages -= nr_done;
+	nread -= (size_t)nr_done << PAGE_CACHE_SHIFT;
 #endif
-	return rc;
+out:
+	for (i = 0; i < nr_pages; i++) {
+		struct page *page = pages[i];
+
+		if (rc) {
+			ClearPageUptodate(page);
+			SetPageError(page);
+		} else {
+			size_t start = (size_t)i << PAGE_CACHE_SHIFT;
+			size_t filled = 0;
+
+			if (nread > start)
+				filled = min_t(size_t, PAGE_CACHE_SIZE,
+					       nread - start);
+			/* past EOF: zero after decrypting */
+			if (filled < PAGE_CACHE_SIZE)
+				zero_user(page, filled,
+					  PAGE_CACHE_SIZE - filled);
+			flush_dcache_page(page);
+			SetPageUptodate(page);
+		}
+		unlock_page(page);
+		page_cache_release(page);
+	}
 }
-/**This function is taken from ecryptfs with necessary changes
- * wrapfs_readpage
+/*
+ * wrapfs_readpages
  * @file: A file
- * @page: Page from wrapfs inode mapping into which to stick the read data
+ * @mapping: The wrapfs inode mapping
+ * @pages: Readahead pages, not yet in the page cache, lowest index last
+ * @nr_pages: Number of pages on @pages
  *
- * Read in a page, decrypting if necessary.
+ * Readahead: add the pages to the page cache and read each run of
+ * consecutive ones, up to WRAPFS_CRYPT_BATCH pages, with one lower read
+ * and one batched decrypt instead of a ->readpage call per page.
  *
- * Returns zero on success; non-zero on error.
+ * Returns zero; failed pages are left not up to date for ->readpage.
  */
-static int wrapfs_readpage(struct file *file, struct page *page)
+static int wrapfs_readpages(struct file *file, struct address_space *mapping,
+			    struct list_head *pages, unsigned nr_pages)
 {
-	int ret = 0;
+	struct page *run[WRAPFS_CRYPT_BATCH];
+	unsigned int nr_run = 0;
 #ifdef EXTRA_CREDIT
 	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
-	ret = wrapfs_read_lower_page_segment(
-					page, page->index, 0,
-					PAGE_CACHE_SIZE, page->mapping->host,
-					file);
-	if (ret) {
-		printk(KERN_ERR "Error decrypting page; "
-						"ret = [%d]\n", ret);
-		goto out;
+	while (!list_empty(pages)) {
+		struct page *page = list_entry(pages->prev, struct page, lru);
+
+		list_del(&page->lru);
+		if (add_to_page_cache_lru(page, mapping, page->index,
+					  GFP_KERNEL)) {
+			/* already cached, or no memory: the run ends here */
+			page_cache_release(page);
+			continue;
+		}
+		if (nr_run && (nr_run == WRAPFS_CRYPT_BATCH ||
+			       run[nr_run - 1]->index + 1 != page->index)) {
+			wrapfs_read_lower_pages(mapping->host, run, nr_run);
+			nr_run = 0;
+		}
+		run[nr_run++] = page;
 	}
-out:
-	if (ret)
-		ClearPageUptodate(page);
-	else
-		SetPageUptodate(page);
-	printk(KERN_DEBUG "Unlocking page with index = [0x%.16lx]\n",
-					page->index);
-	unlock_page(page);
+	if (nr_run)
+		wrapfs_read_lower_pages(mapping->host, run, nr_run);
 #ifdef EXTRA_CREDIT
 	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
-		DBGRET(ret);
+		DBGRET(0);
 #endif
-	return ret;
+	return 0;
 }
 /**
  * This function is taken from ecryptfs with necessary changes
@@ -439,10 +1120,11 @@ struct page *wrapfs_get_locked_page(struct inode *inode,
  * @size: The number of bytes to write from @data
  *
  * Write an arbitrary amount of data to an arbitrary location in the
- * wrapfs inode page cache. This is done on a page-by-page. This function
- * takes care of all the address translation to locations in the lower
- * filesystem; it also handles truncate events, writing out zeros
- * where necessary.
+ * wrapfs inode page cache. This is done on a page-by-page. The pages
+ * are only dirtied; writeback encrypts them into the lower file later.
+ * It also handles truncate events: writing past EOF zeroes the rest of
+ * the old last page and the start of the page at @offset, and leaves
+ * the whole pages in between as holes in the lower file.
  *
  * Returns zero on success; non-zero otherwise
  */
@@ -468,10 +1150,19 @@ int wrapfs_write(struct inode *wrapfs_inode, char *data, loff_t offset,
 	else
 		curr_pos = offset;
 	while (curr_pos < (offset + size)) {
-		pgoff_t wrapfs_page_idx = (curr_pos >> PAGE_CACHE_SHIFT);
-		size_t start_offset_in_page = (curr_pos & ~PAGE_CACHE_MASK);
-		size_t num_bytes = (PAGE_CACHE_SIZE - start_offset_in_page);
-		size_t total_remaining_bytes = ((offset + size) - curr_pos);
+		pgoff_t wrapfs_page_idx;
+		size_t start_offset_in_page;
+		size_t num_bytes;
+		size_t total_remaining_bytes;
+
+		/* whole pages of zeros are left to be holes */
+		if (curr_pos < offset && !(curr_pos & ~PAGE_CACHE_MASK))
+			curr_pos = max_t(loff_t, curr_pos,
+					 offset - (offset & ~PAGE_CACHE_MASK));
+		wrapfs_page_idx = (curr_pos >> PAGE_CACHE_SHIFT);
+		start_offset_in_page = (curr_pos & ~PAGE_CACHE_MASK);
+		num_bytes = (PAGE_CACHE_SIZE - start_offset_in_page);
+		total_remaining_bytes = ((offset + size) - curr_pos);
 
 		if (num_bytes > total_remaining_bytes)
 			num_bytes = total_remaining_bytes;
@@ -516,18 +1207,11 @@ int wrapfs_write(struct inode *wrapfs_inode, char *data, loff_t offset,
 		kunmap_atomic(wrapfs_page_virt, KM_USER0);
 		flush_dcache_page(wrapfs_page);
 		SetPageUptodate(wrapfs_page);
+		wrapfs_set_dirty_range(wrapfs_page, start_offset_in_page,
+				       start_offset_in_page + num_bytes);
+		set_page_dirty(wrapfs_page);
 		unlock_page(wrapfs_page);
-		rc = wrapfs_write_lower_page_segment(wrapfs_inode,
-						wrapfs_page,
-						start_offset_in_page,
-						data_offset,
-						file);
 		page_cache_release(wrapfs_page);
-		if (rc) {
-			printk(KERN_ERR "%s: Error encrypting "
-			       "page; rc = [%d]\n", __func__, rc);
-			goto out;
-		}
 		curr_pos += num_bytes;
 	}
 	if ((offset + size) > wrapfs_file_size)
@@ -540,6 +1224,175 @@ out:
 	return rc;
 }
 
+/*
+ * Write zeros over [@from, @to) through the page cache, for the parts of
+ * pages that a punched hole only partly covers.  Nothing past i_size may
+ * be asked for: wrapfs_write() would grow the file.
+ */
+int wrapfs_zero_range(struct inode *inode, loff_t from, loff_t to,
+		      struct file *file)
+{
+	char *zeros;
+	int rc = 0;
+
+	if (from >= to)
+		return 0;
+	zeros = kzalloc(PAGE_CACHE_SIZE, GFP_KERNEL);
+	if (!zeros)
+		return -ENOMEM;
+	while (from < to && !rc) {
+		size_t n = min_t(loff_t, to - from, PAGE_CACHE_SIZE);
+
+		rc = wrapfs_write(inode, zeros, from, n, file);
+		from += n;
+	}
+	kfree(zeros);
+	return rc;
+}
+
+/*
+ * Copy @len raw bytes between the lower files of @src_inode and
+ * @dst_inode, for wrapfs_copy_range().  Returns the bytes copied.
+ */
+static ssize_t wrapfs_copy_lower(struct inode *src_inode, loff_t src_off,
+				 struct inode *dst_inode, loff_t dst_off,
+				 size_t len)
+{
+	struct file *lower_src, *lower_dst;
+	mm_segment_t fs_save;
+	char *buf;
+	size_t done = 0;
+	ssize_t rc = -EIO;
+
+	buf = (char *)__get_free_page(GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	lower_src = wrapfs_get_inode_lower_file(src_inode);
+	lower_dst = wrapfs_get_inode_lower_file(dst_inode);
+	if (!lower_src || !lower_dst)
+		goto out;
+	fs_save = get_fs();
+	set_fs(get_ds());
+	while (done < len) {
+		size_t n = min_t(size_t, len - done, PAGE_CACHE_SIZE);
+
+		rc = vfs_read(lower_src, buf, n, &src_off);
+		if (rc <= 0)
+			break;
+		n = rc;
+		rc = vfs_write(lower_dst, buf, n, &dst_off);
+		if (rc < 0)
+			break;
+		if (rc != n) {
+			rc = -EIO;
+			break;
+		}
+		done += n;
+	}
+	set_fs(fs_save);
+out:
+	if (lower_src)
+		fput(lower_src);
+	if (lower_dst)
+		fput(lower_dst);
+	free_page((unsigned long)buf);
+	return done ? done : rc;
+}
+
+/*
+ * Copy @len bytes at @src_off of @src to @dst_off of @dst, two
+ * address-space mode files of one mount, for WRAPFS_IOC_COPY_RANGE.
+ * Unencrypted, and with the ctr layout, whose keystream depends only
+ * on the offset in the page, the lower bytes are copied as they are.
+ * With encryption that takes both offsets on a page boundary and
+ * whole pages, bar the last one when it ends at both EOFs, so that no
+ * page ends up part copied ciphertext and part something else (see
+ * the holes above).  Anything else goes through the page cache,
+ * decrypted from @src and encrypted into @dst at writeback.
+ *
+ * Called with @dst's i_mutex held.  Returns the bytes copied.
+ */
+ssize_t wrapfs_copy_range(struct file *src, loff_t src_off,
+			  struct file *dst, loff_t dst_off, size_t len)
+{
+	struct inode *src_inode = src->f_path.dentry->d_inode;
+	struct inode *dst_inode = dst->f_path.dentry->d_inode;
+	loff_t src_size = i_size_read(src_inode);
+	loff_t dst_size = i_size_read(dst_inode);
+	bool raw = true;
+	size_t done = 0;
+	ssize_t rc = 0;
+#ifdef EXTRA_CREDIT
+	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
+		UDBG;
+#endif
+	if (src_off >= src_size)
+		goto out;
+	len = min_t(loff_t, len, src_size - src_off);
+#ifdef WRAPFS_CRYPTO
+	raw = !WRAPFS_SB(dst_inode->i_sb)->crypt.mode->per_file_iv &&
+		!(src_off & ~PAGE_CACHE_MASK) &&
+		!(dst_off & ~PAGE_CACHE_MASK) &&
+		(!(len & ~PAGE_CACHE_MASK) ||
+		 (src_off + len == src_size && dst_off + len >= dst_size));
+#endif
+	if (!raw)
+		goto copy_cached;
+
+	rc = filemap_write_and_wait_range(src_inode->i_mapping, src_off,
+					  src_off + len - 1);
+	if (!rc)
+		rc = filemap_write_and_wait_range(dst_inode->i_mapping,
+						  dst_off, dst_off + len - 1);
+	/* the gap up to @dst_off is grown the way truncate grows files */
+	if (!rc && dst_off > dst_size)
+		rc = wrapfs_truncate(dst->f_path.dentry, dst_off, dst);
+	if (rc)
+		goto out;
+	rc = wrapfs_copy_lower(src_inode, src_off, dst_inode, dst_off, len);
+	if (rc <= 0)
+		goto out;
+	invalidate_inode_pages2_range(dst_inode->i_mapping,
+				      dst_off >> PAGE_CACHE_SHIFT,
+				      (dst_off + rc - 1) >> PAGE_CACHE_SHIFT);
+	if (dst_off + rc > i_size_read(dst_inode))
+		i_size_write(dst_inode, dst_off + rc);
+	fsstack_copy_attr_times(dst_inode, wrapfs_lower_inode(dst_inode));
+	goto out;
+
+copy_cached:
+	while (done < len) {
+		loff_t pos = src_off + done;
+		size_t offset = pos & ~PAGE_CACHE_MASK;
+		size_t n = min_t(size_t, len - done, PAGE_CACHE_SIZE - offset);
+		struct page *page;
+		char *virt;
+
+		page = read_mapping_page(src_inode->i_mapping,
+					 pos >> PAGE_CACHE_SHIFT, src);
+		if (IS_ERR(page)) {
+			rc = PTR_ERR(page);
+			break;
+		}
+		virt = kmap(page);
+		rc = wrapfs_write(dst_inode, virt + offset, dst_off + done, n,
+				  dst);
+		kunmap(page);
+		page_cache_release(page);
+		if (rc)
+			break;
+		done += n;
+	}
+	if (done)
+		rc = done;
+out:
+#ifdef EXTRA_CREDIT
+	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
+		DBGRET((int)rc);
+#endif
+	return rc;
+}
+
 /**
  *This function is taken from ecryptfs with necessary changes
  * truncate_upper
@@ -548,9 +1401,10 @@ out:
  * @lower_ia: Address of the lower inode's attributes
  *
  * Function to handle truncations modifying the size of the file. Note
- * that the file sizes are interpolated. When expanding, we are simply
- * writing strings of 0's out. When truncating, we truncate the upper
- * inode and update the lower_ia according to the page index
+ * that the file sizes are interpolated. When expanding, we write 0's
+ * over the partial pages at the old and the new end of file only; the
+ * whole pages in between become holes. When truncating, we truncate the
+ * upper inode and update the lower_ia according to the page index
  * interpolations. If ATTR_SIZE is set in lower_ia->ia_valid upon return,
  * the caller must use lower_ia in a call to notify_change() to perform
  * the truncation of the lower inode.
@@ -577,11 +1431,27 @@ static int truncate_upper(struct dentry *dentry, struct iattr *ia,
 
 		lower_ia->ia_valid &= ~ATTR_SIZE;
 		/* Write a single 0 at the last position of the file;
-		 * this triggers code that will fill in 0's throughout
-		 * the intermediate portion of the previous end of the
-		 * file and the new and of the file */
-		rc = wrapfs_write(inode, zero,
-				(ia->ia_size - 1), 1, file);
+		 * this triggers code that will fill in 0's from the
+		 * previous end of the file to the end of its page, and
+		 * from the start of the new last page to the new end of
+		 * the file.  Everything in between stays a hole.  A
+		 * new end of file on a page boundary needs no page of
+		 * its own: the lower file is just made longer. */
+		if (ia->ia_size & ~PAGE_CACHE_MASK) {
+			rc = wrapfs_write(inode, zero,
+					(ia->ia_size - 1), 1, file);
+			goto out;
+		}
+		if (i_size & ~PAGE_CACHE_MASK) {
+			rc = wrapfs_write(inode, zero,
+					round_up(i_size, PAGE_CACHE_SIZE) - 1,
+					1, file);
+			if (rc)
+				goto out;
+		}
+		i_size_write(inode, ia->ia_size);
+		lower_ia->ia_size = ia->ia_size;
+		lower_ia->ia_valid |= ATTR_SIZE;
 	} else { /* ia->ia_size < i_size_read(inode) */
 		/* We're chopping off all the pages down to the page
 		 * in which ia->ia_size is located. Fill in the end of
@@ -600,7 +1470,7 @@ static int truncate_upper(struct dentry *dentry, struct iattr *ia,
 		rc = inode_newsize_ok(inode, ia->ia_size);
 		if (rc)
 			goto out;
-		if (strlen(WRAPFS_SB(dentry->d_inode->i_sb)->key) == 0) {
+		if (!wrapfs_has_key(dentry->d_inode->i_sb)) {
 			truncate_setsize(inode, ia->ia_size);
 			lower_ia->ia_size = ia->ia_size;
 			lower_ia->ia_valid |= ATTR_SIZE;
@@ -713,8 +1583,7 @@ static int wrapfs_write_begin(struct file *file,
 			ret = wrapfs_read_lower_page_segment(
 							 page, index, 0,
 							 PAGE_CACHE_SIZE,
-							 mapping->host,
-							 file);
+							 mapping->host);
 			if (ret) {
 				printk(KERN_ERR "%s: Error decrypting "
 					   "page at index [%ld]; "
@@ -726,25 +1595,29 @@ static int wrapfs_write_begin(struct file *file,
 		}
 		SetPageUptodate(page);
 	}
-	/* If creating a page or more of holes, zero them out via truncate.
-	 * Note, this will increase i_size. */
+	/* If creating a page or more of holes, zero the rest of the old
+	 * last page via truncate; the whole pages after it stay holes in
+	 * the lower file.  Note, this will increase i_size. */
 	if (index != 0) {
-		if (prev_page_end_size > i_size_read(page->mapping->host)) {
+		loff_t i_size = i_size_read(page->mapping->host);
+		loff_t old_page_end = round_up(i_size, PAGE_CACHE_SIZE);
+
+		if (prev_page_end_size > i_size && old_page_end != i_size) {
 			ret = wrapfs_truncate(file->f_path.dentry,
-							 prev_page_end_size,
+							 old_page_end,
 							 file);
 			if (ret) {
 				printk(KERN_ERR "%s: Error on attempt to "
 				       "truncate to (higher) offset [%lld];"
 				       " ret = [%d]\n", __func__,
-				       prev_page_end_size, ret);
+				       old_page_end, ret);
 				goto out;
 			}
 		}
 	}
 	/* Writing to a new page, and creating a small hole from start
 	 * of page?  Zero it out. */
-	if ((i_size_read(mapping->host) == prev_page_end_size)
+	if ((i_size_read(mapping->host) <= prev_page_end_size)
 		&& (pos != 0)) {
 		printk(KERN_INFO "Creating a small hole from start\n");
 		zero_user(page, 0, PAGE_CACHE_SIZE);
@@ -772,8 +1645,9 @@ out:
  * @page: The page
  * @fsdata: The fsdata (unused)
  *
- * This is where we encrypt the data and pass the encrypted data to
- * the lower filesystem.
+ * Only records the bytes written in the page's dirty range, dirties it
+ * and moves i_size; the range is encrypted and passed to the lower
+ * filesystem at writeback time.
  */
 static int wrapfs_write_end(struct file *file,
 						struct address_space *mapping,
@@ -782,30 +1656,26 @@ static int wrapfs_write_end(struct file *file,
 						struct page *page, void *fsdata)
 {
 	int ret = 0;
-	/*pgoff_t index = pos >> PAGE_CACHE_SHIFT;*/
-	unsigned from = pos & (PAGE_CACHE_SIZE - 1);
-	unsigned to = from + copied;
 	struct inode *wrapfs_inode = mapping->host;
-	int need_unlock_page = 1;
+	loff_t page_start = page_offset(page);
+	loff_t i_size = i_size_read(wrapfs_inode);
+	size_t from = pos & (PAGE_CACHE_SIZE - 1);
 #ifdef EXTRA_CREDIT
 	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
-	ret = wrapfs_write_lower_page_segment(
-							wrapfs_inode,
-							page, 0,
-							to, file);
-
-	if (!ret) {
-		ret = copied;
-		fsstack_copy_inode_size(wrapfs_inode,
-					wrapfs_lower_inode(wrapfs_inode));
-	} else{
-		goto out;
+	/*
+	 * Writing past EOF leaves zeros between the old EOF and @pos in
+	 * this page that the lower file doesn't have yet: write them too.
+	 */
+	if (pos > i_size)
+		from = i_size > page_start ? i_size - page_start : 0;
+	if (copied) {
+		wrapfs_set_dirty_range(page, from,
+				       (pos & (PAGE_CACHE_SIZE - 1)) + copied);
+		set_page_dirty(page);
 	}
-	set_page_dirty(page);
 	unlock_page(page);
-	need_unlock_page = 0;
 	if (pos + copied > i_size_read(wrapfs_inode)) {
 		i_size_write(wrapfs_inode, pos + copied);
 		printk(KERN_DEBUG "Expanded file size to "
@@ -814,9 +1684,6 @@ static int wrapfs_write_end(struct file *file,
 		balance_dirty_pages_ratelimited(mapping);
 	}
 	ret = copied;
-out:
-	if (need_unlock_page)
-		unlock_page(page);
 	page_cache_release(page);
 #ifdef EXTRA_CREDIT
 	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
@@ -824,6 +1691,20 @@ out:
 #endif
 	return ret;
 }
+/* truncate: a page gone from the cache takes its dirty range along */
+static void wrapfs_invalidatepage(struct page *page, unsigned long offset)
+{
+	if (!offset)
+		wrapfs_clear_dirty_range(page);
+}
+
+static int wrapfs_releasepage(struct page *page, gfp_t gfp)
+{
+	if (PageDirty(page))
+		return 0;
+	wrapfs_clear_dirty_range(page);
+	return 1;
+}
 static sector_t wrapfs_bmap(struct address_space *mapping, sector_t block)
 {
 	int ret = 0;
@@ -845,6 +1726,372 @@ static sector_t wrapfs_bmap(struct address_space *mapping, sector_t block)
 #endif
 	return ret;
 }
+/*
+ * O_DIRECT alignment: what the lower file system would demand of a
+ * direct I/O of its own, the logical block size of its device.  Modes
+ * whose counter can't start inside a page need whole pages.
+ */
+static unsigned int wrapfs_dio_alignment(struct inode *wrapfs_inode)
+{
+	struct inode *lower_inode = wrapfs_lower_inode(wrapfs_inode);
+	unsigned int align = 1 << lower_inode->i_blkbits;
+
+	if (lower_inode->i_sb->s_bdev)
+		align = bdev_logical_block_size(lower_inode->i_sb->s_bdev);
+#ifdef WRAPFS_CRYPTO
+	if (!WRAPFS_SB(wrapfs_inode->i_sb)->crypt.mode->ctr_block)
+		align = PAGE_CACHE_SIZE;
+#endif
+	return align;
+}
+
+#ifdef WRAPFS_CRYPTO
+/*
+ * Lay [@from of the first page, @to of the last page) of @pages out in
+ * @sg, each entry at the offset its bytes have in the file's page.
+ */
+static void wrapfs_dio_sg(struct scatterlist *sg, struct page **pages,
+			  unsigned int nr_pages, size_t from, size_t to)
+{
+	unsigned int i;
+
+	sg_init_table(sg, nr_pages);
+	for (i = 0; i < nr_pages; i++) {
+		size_t start = i ? 0 : from;
+		size_t end = (i == nr_pages - 1) ? to : PAGE_CACHE_SIZE;
+
+		sg_set_page(&sg[i], pages[i], end - start, start);
+	}
+}
+
+/*
+ * Copy the bytes described by @sg to (@to_user) or from the user
+ * buffers at *@iov + *@iov_off, and move that position past them.
+ */
+static int wrapfs_dio_copy(struct scatterlist *sg, unsigned int nr,
+			   const struct iovec **iov, size_t *iov_off,
+			   int to_user)
+{
+	unsigned int i;
+	int rc = 0;
+
+	for (i = 0; i < nr && !rc; i++) {
+		char *virt = (char *)kmap(sg_page(&sg[i])) + sg[i].offset;
+		size_t len = sg[i].length;
+
+		while (len) {
+			char __user *buf = (*iov)->iov_base + *iov_off;
+			size_t n = min(len, (*iov)->iov_len - *iov_off);
+
+			if (to_user ? copy_to_user(buf, virt, n) :
+				      copy_from_user(virt, buf, n)) {
+				rc = -EFAULT;
+				break;
+			}
+			virt += n;
+			len -= n;
+			*iov_off += n;
+			if (*iov_off == (*iov)->iov_len) {
+				(*iov)++;
+				*iov_off = 0;
+			}
+		}
+		kunmap(sg_page(&sg[i]));
+	}
+	return rc;
+}
+
+/*
+ * Read the lower file at @offset into the run @sg of bounce pages, and
+ * drop the lower pages it went through.  Returns the bytes read.
+ */
+static ssize_t wrapfs_dio_read_lower(struct inode *wrapfs_inode,
+				     struct scatterlist *sg, unsigned int nr,
+				     loff_t offset)
+{
+	struct iovec iov[WRAPFS_CRYPT_BATCH];
+	struct file *lower_file;
+	mm_segment_t fs_save;
+	pgoff_t index = offset >> PAGE_CACHE_SHIFT;
+	unsigned int i;
+	ssize_t rc;
+
+	lower_file = wrapfs_get_inode_lower_file(wrapfs_inode);
+	if (!lower_file)
+		return -EIO;
+	for (i = 0; i < nr; i++) {
+		iov[i].iov_base = (char *)kmap(sg_page(&sg[i])) + sg[i].offset;
+		iov[i].iov_len = sg[i].length;
+	}
+	fs_save = get_fs();
+	set_fs(get_ds());
+	rc = vfs_readv(lower_file, (const struct iovec __user *)iov, nr,
+		       &offset);
+	set_fs(fs_save);
+	for (i = 0; i < nr; i++)
+		kunmap(sg_page(&sg[i]));
+	fput(lower_file);
+	invalidate_mapping_pages(wrapfs_lower_inode(wrapfs_inode)->i_mapping,
+				 index, index + nr - 1);
+	return rc;
+}
+
+/*
+ * A direct write that covers only part of a page can't just write its
+ * part: if the page is a hole, the rest of it would stay zeros next to
+ * ciphertext.  Fill @page with the plaintext of lower page @index, zeros
+ * past the lower EOF, so the write can take the whole page along.
+ * Returns the bytes of data the lower file has in the page.
+ */
+static ssize_t wrapfs_dio_fill_page(struct inode *wrapfs_inode,
+				    struct page *page, pgoff_t index)
+{
+	struct scatterlist sg;
+	ssize_t rc;
+	int err;
+
+	sg_init_table(&sg, 1);
+	sg_set_page(&sg, page, PAGE_CACHE_SIZE, 0);
+	rc = wrapfs_dio_read_lower(wrapfs_inode, &sg, 1,
+				   (loff_t)index << PAGE_CACHE_SHIFT);
+	if (rc < 0)
+		return rc;
+	err = wrapfs_decrypt_holes(wrapfs_inode, index, &page, &page, 1, rc);
+	if (err)
+		return err;
+	zero_user(page, rc, PAGE_CACHE_SIZE - rc);
+	return rc;
+}
+
+/*
+ * A direct write that starts past the page holding the old EOF never
+ * touches that page, so its tail would stay lower zeros after the
+ * ciphertext and read back as keystream.  Pad it out to the page
+ * boundary the way wrapfs_write_begin() does for buffered writes, then
+ * get it to the lower file and out of both page caches.
+ */
+static int wrapfs_dio_pad_eof(struct file *file, loff_t size)
+{
+	struct address_space *mapping = file->f_mapping;
+	struct address_space *lower_mapping =
+		wrapfs_lower_inode(mapping->host)->i_mapping;
+	loff_t start = size & PAGE_CACHE_MASK;
+	loff_t end = round_up(size, PAGE_CACHE_SIZE) - 1;
+	pgoff_t index = size >> PAGE_CACHE_SHIFT;
+	int rc;
+
+	rc = wrapfs_truncate(file->f_path.dentry, end + 1, file);
+	if (!rc)
+		rc = filemap_write_and_wait_range(mapping, start, end);
+	if (!rc)
+		rc = filemap_write_and_wait_range(lower_mapping, start, end);
+	invalidate_inode_pages2_range(mapping, index, index);
+	invalidate_inode_pages2_range(lower_mapping, index, index);
+	return rc;
+}
+
+/*
+ * wrapfs_crypt_direct_IO
+ * @rw: READ or WRITE
+ * @file: The wrapfs file
+ * @iov: The caller's (aligned) user buffers
+ * @offset: File offset of the I/O, aligned
+ * @count: Bytes in @iov
+ *
+ * Direct I/O on ciphertext goes through bounce pages from the mount's
+ * pool, up to WRAPFS_CRYPT_BATCH pages at a time.  Writes copy the user
+ * data in, encrypt it there and write it to the lower file, taking the
+ * rest of partly covered pages along; reads go by whole pages, so that
+ * holes are recognised, and copy out the part asked for.  This kernel
+ * can't issue O_DIRECT on kernel buffers, so the lower I/O is buffered,
+ * but a write is on disk before we return and the lower pages of
+ * either are dropped right away: nothing of the file stays cached in
+ * either page cache.
+ *
+ * Returns the bytes transferred, or a negative error if there were none
+ */
+static ssize_t wrapfs_crypt_direct_IO(int rw, struct file *file,
+				      const struct iovec *iov, loff_t offset,
+				      size_t count)
+{
+	struct inode *wrapfs_inode = file->f_mapping->host;
+	struct super_block *sb = wrapfs_inode->i_sb;
+	struct address_space *lower_mapping =
+		wrapfs_lower_inode(wrapfs_inode)->i_mapping;
+	struct page *bounce[WRAPFS_CRYPT_BATCH];
+	struct scatterlist sg[WRAPFS_CRYPT_BATCH];
+	size_t iov_off = 0, done = 0;
+	ssize_t rc = 0;
+
+	if (!wrapfs_has_key(sb)) {
+		printk(KERN_ERR "key Not Set\n");
+		return -EPERM;
+	}
+	if (rw == READ) {
+		loff_t size = i_size_read(wrapfs_inode);
+
+		if (offset >= size)
+			return 0;
+		count = min_t(loff_t, count, size - offset);
+	} else {
+		loff_t size = i_size_read(wrapfs_inode);
+
+		if ((size & ~PAGE_CACHE_MASK) &&
+		    offset >= round_up(size, PAGE_CACHE_SIZE)) {
+			rc = wrapfs_dio_pad_eof(file, size);
+			if (rc)
+				return rc;
+		}
+	}
+	while (done < count) {
+		pgoff_t index = offset >> PAGE_CACHE_SHIFT;
+		size_t from = offset & ~PAGE_CACHE_MASK;
+		size_t len, to;
+		unsigned int nr, nr_data;
+
+		nr = min_t(size_t, WRAPFS_CRYPT_BATCH,
+			   DIV_ROUND_UP(from + count - done, PAGE_CACHE_SIZE));
+		nr = wrapfs_get_bounce_pages(sb, bounce, nr);
+		len = min(count - done,
+			  ((size_t)nr << PAGE_CACHE_SHIFT) - from);
+		to = from + len - ((size_t)(nr - 1) << PAGE_CACHE_SHIFT);
+
+		if (rw == WRITE) {
+			size_t wfrom = from, wto = to;
+			loff_t pos;
+
+			if (from) {
+				rc = wrapfs_dio_fill_page(wrapfs_inode,
+							  bounce[0], index);
+				if (rc < 0)
+					goto next;
+				wfrom = 0;
+				if (nr == 1)
+					wto = max_t(size_t, to, rc);
+			}
+			if (to != PAGE_CACHE_SIZE && (nr > 1 || !from)) {
+				rc = wrapfs_dio_fill_page(wrapfs_inode,
+							  bounce[nr - 1],
+							  index + nr - 1);
+				if (rc < 0)
+					goto next;
+				wto = max_t(size_t, to, rc);
+			}
+			wrapfs_dio_sg(sg, bounce, nr, from, to);
+			rc = wrapfs_dio_copy(sg, nr, &iov, &iov_off, 0);
+			if (rc)
+				goto next;
+			wrapfs_dio_sg(sg, bounce, nr, wfrom, wto);
+			rc = wrapfs_crypt_sg(wrapfs_inode, index, sg, sg,
+					     nr, 1);
+			pos = ((loff_t)index << PAGE_CACHE_SHIFT) + wfrom;
+			if (!rc)
+				rc = __wrapfs_write_lower_pages(wrapfs_inode,
+						bounce, nr, pos, wfrom, wto);
+			if (!rc)
+				rc = filemap_write_and_wait_range(
+					lower_mapping, pos,
+					((loff_t)(index + nr - 1) <<
+					 PAGE_CACHE_SHIFT) + wto - 1);
+			invalidate_inode_pages2_range(lower_mapping, index,
+						      index + nr - 1);
+			goto next;
+		}
+
+		wrapfs_dio_sg(sg, bounce, nr, 0, PAGE_CACHE_SIZE);
+		rc = wrapfs_dio_read_lower(wrapfs_inode, sg, nr,
+					   (loff_t)index << PAGE_CACHE_SHIFT);
+		if (rc < 0)
+			goto next;
+		if (rc < from + len) {
+			/* the file got shorter under us: stop there */
+			len = rc > from ? rc - from : 0;
+			count = done + len;
+			if (!len)
+				goto next;
+		}
+		rc = wrapfs_decrypt_holes(wrapfs_inode, index, bounce, bounce,
+					  nr, rc);
+		if (rc)
+			goto next;
+		nr_data = DIV_ROUND_UP(from + len, PAGE_CACHE_SIZE);
+		to = from + len - ((size_t)(nr_data - 1) << PAGE_CACHE_SHIFT);
+		wrapfs_dio_sg(sg, bounce, nr_data, from, to);
+		rc = wrapfs_dio_copy(sg, nr_data, &iov, &iov_off, 1);
+next:
+		wrapfs_put_bounce_pages(sb, bounce, nr);
+		if (rc < 0)
+			break;
+		rc = 0;
+		done += len;
+		offset += len;
+	}
+	if (rw == WRITE && done)
+		mark_inode_dirty_sync(wrapfs_inode);
+	return done ? done : rc;
+}
+#endif
+
+/*
+ * ->direct_IO, so that O_DIRECT opens work: the page cache is flushed
+ * and invalidated around us by the caller, and the data goes to the
+ * lower file without staying in our pages or the lower file's.
+ */
+static ssize_t wrapfs_direct_IO(int rw, struct kiocb *iocb,
+				const struct iovec *iov, loff_t offset,
+				unsigned long nr_segs)
+{
+	struct inode *wrapfs_inode = iocb->ki_filp->f_mapping->host;
+	unsigned int align = wrapfs_dio_alignment(wrapfs_inode);
+	unsigned long seg;
+	ssize_t rc;
+#ifndef WRAPFS_CRYPTO
+	struct file *lower_file;
+	size_t done = 0;
+#endif
+#ifdef EXTRA_CREDIT
+	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
+		UDBG;
+#endif
+	rc = -EINVAL;
+	if (offset & (align - 1))
+		goto out;
+	for (seg = 0; seg < nr_segs; seg++)
+		if (((unsigned long)iov[seg].iov_base | iov[seg].iov_len) &
+		    (align - 1))
+			goto out;
+#ifdef WRAPFS_CRYPTO
+	rc = wrapfs_crypt_direct_IO(rw, iocb->ki_filp, iov, offset,
+				    iov_length(iov, nr_segs));
+#else
+	/*
+	 * Plaintext needs no bounce: the lower open has our flags, O_DIRECT
+	 * included, so hand it the user buffers one segment at a time.
+	 */
+	lower_file = wrapfs_lower_file(iocb->ki_filp);
+	for (seg = 0; seg < nr_segs; seg++) {
+		if (rw == WRITE)
+			rc = vfs_write(lower_file, iov[seg].iov_base,
+				       iov[seg].iov_len, &offset);
+		else
+			rc = vfs_read(lower_file, iov[seg].iov_base,
+				      iov[seg].iov_len, &offset);
+		if (rc <= 0)
+			break;
+		done += rc;
+		if (rc < iov[seg].iov_len)
+			break;
+	}
+	if (done)
+		rc = done;
+#endif
+out:
+#ifdef EXTRA_CREDIT
+	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
+		DBGRET(rc);
+#endif
+	return rc;
+}
 static int wrapfs_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
 	int err;
@@ -880,6 +2127,42 @@ static int wrapfs_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	return err;
 }
 
+/*
+ * A store through a shared mapping of an address-space mode file is
+ * about to dirty @vmf->page.  It may land anywhere in the page, so
+ * writeback is told to write all of it (up to EOF, as always); the
+ * page is encrypted there like one dirtied by write().
+ */
+static int wrapfs_page_mkwrite(struct vm_area_struct *vma,
+			       struct vm_fault *vmf)
+{
+	struct page *page = vmf->page;
+	struct inode *inode = vma->vm_file->f_path.dentry->d_inode;
+	int ret = VM_FAULT_LOCKED;
+#ifdef EXTRA_CREDIT
+	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
+		UDBG;
+#endif
+	file_update_time(vma->vm_file);
+	lock_page(page);
+	if (page->mapping != inode->i_mapping ||
+	    page_offset(page) >= i_size_read(inode)) {
+		/* truncated under us: let the fault be retried */
+		unlock_page(page);
+		ret = VM_FAULT_NOPAGE;
+		goto out;
+	}
+	wrapfs_set_dirty_range(page, 0, PAGE_CACHE_SIZE);
+	set_page_dirty(page);
+	wait_on_page_writeback(page);
+out:
+#ifdef EXTRA_CREDIT
+	if (debug_opt & A_DOPS || debug_opt & ALL_DOPS)
+		DBGRET(ret);
+#endif
+	return ret;
+}
+
 /*
  * XXX: the default address_space_ops for wrapfs is empty.  We cannot set
  * our inode->i_mapping->a_ops to NULL because too many code paths expect
@@ -887,12 +2170,23 @@ static int wrapfs_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
  */
 const struct address_space_operations wrapfs_aops = {
 	.writepage = wrapfs_writepage,
+	.writepages = wrapfs_writepages,
 	.readpage = wrapfs_readpage,
+	.readpages = wrapfs_readpages,
 	.write_begin = wrapfs_write_begin,
 	.write_end = wrapfs_write_end,
 	.bmap = wrapfs_bmap,
+	.direct_IO = wrapfs_direct_IO,
+	.invalidatepage = wrapfs_invalidatepage,
+	.releasepage = wrapfs_releasepage,
 };
 
 const struct vm_operations_struct wrapfs_vm_ops = {
 	.fault		= wrapfs_fault,
 };
+
+/* address-space mode maps our own, plaintext, page cache */
+const struct vm_operations_struct wrapfs_vm_ops_add_space = {
+	.fault		= filemap_fault,
+	.page_mkwrite	= wrapfs_page_mkwrite,
+};
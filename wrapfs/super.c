@@ -35,6 +35,9 @@ static void wrapfs_put_super(struct super_block *sb)
 	wrapfs_set_lower_super(sb, NULL);
 	atomic_dec(&s->s_active);
 
+#ifdef WRAPFS_CRYPTO
+	wrapfs_crypt_destroy(sb);
+#endif
 	kfree(spd);
 	sb->s_fs_info = NULL;
 }
@@ -47,9 +50,8 @@ static int wrapfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	if (debug_opt & S_DOPS || debug_opt & ALL_DOPS)
 		UDBG;
 #endif
-	wrapfs_get_lower_path(dentry, &lower_path);
+	wrapfs_borrow_lower_path(dentry, &lower_path);
 	err = vfs_statfs(&lower_path, buf);
-	wrapfs_put_lower_path(dentry, &lower_path);
 
 	/* set return buf to our f/s to avoid confusing user-level utils */
 	buf->f_type = WRAPFS_SUPER_MAGIC;
@@ -60,6 +62,40 @@ static int wrapfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	return err;
 }
 
+/* per-mount counters, shown in /proc/self/mountstats */
+static int wrapfs_show_stats(struct seq_file *m, struct vfsmount *mnt)
+{
+	struct wrapfs_stats *st = &WRAPFS_SB(mnt->mnt_sb)->stats;
+
+	seq_printf(m, "\n\tcrypto: tfm_allocs=%ld tfm_frees=%ld setkeys=%ld"
+		   " pages_encrypted=%ld pages_decrypted=%ld",
+		   atomic_long_read(&st->tfm_allocs),
+		   atomic_long_read(&st->tfm_frees),
+		   atomic_long_read(&st->setkeys),
+		   atomic_long_read(&st->pages_encrypted),
+		   atomic_long_read(&st->pages_decrypted));
+	seq_printf(m, "\n\tasync: submitted=%ld fallbacks=%ld",
+		   atomic_long_read(&st->async_submitted),
+		   atomic_long_read(&st->async_fallbacks));
+	seq_printf(m, "\n\tcache: nocache_lower=%d lower_dropped=%ld",
+		   WRAPFS_SB(mnt->mnt_sb)->nocache_lower,
+		   atomic_long_read(&st->lower_dropped));
+#ifdef WRAPFS_CRYPTO
+	seq_printf(m, "\n\tcipher: %s",
+		   WRAPFS_SB(mnt->mnt_sb)->crypt.mode->name);
+	seq_printf(m, "\n\tnames: encnames=%d hits=%ld misses=%ld",
+		   WRAPFS_SB(mnt->mnt_sb)->crypt.encnames,
+		   atomic_long_read(&st->name_hits),
+		   atomic_long_read(&st->name_misses));
+	seq_printf(m, "\n\tbounce: reserve=%d in_use=%ld high_water=%ld"
+		   " waits=%ld", WRAPFS_SB(mnt->mnt_sb)->bounce_reserve,
+		   atomic_long_read(&st->bounce_in_use),
+		   atomic_long_read(&st->bounce_high_water),
+		   atomic_long_read(&st->bounce_waits));
+#endif
+	return 0;
+}
+
 /*
  * @flags: numeric mount options
  * @options: mount options string
@@ -110,6 +146,7 @@ static void wrapfs_evict_inode(struct inode *inode)
 	lower_inode = wrapfs_lower_inode(inode);
 	wrapfs_set_lower_inode(inode, NULL);
 	iput(lower_inode);
+	wrapfs_dir_changed(inode);
 }
 
 static struct inode *wrapfs_alloc_inode(struct super_block *sb)
@@ -125,6 +162,8 @@ static struct inode *wrapfs_alloc_inode(struct super_block *sb)
 
 	/* memset everything up to the inode to 0 */
 	memset(i, 0, offsetof(struct wrapfs_inode_info, vfs_inode));
+	mutex_init(&i->lower_file_mutex);
+	spin_lock_init(&i->lower_file_lock);
 
 	i->vfs_inode.i_version = 1;
 	return &i->vfs_inode;
@@ -200,6 +239,7 @@ const struct super_operations wrapfs_sops = {
 	.evict_inode	= wrapfs_evict_inode,
 	.umount_begin	= wrapfs_umount_begin,
 	.show_options	= generic_show_options,
+	.show_stats	= wrapfs_show_stats,
 	.alloc_inode	= wrapfs_alloc_inode,
 	.destroy_inode	= wrapfs_destroy_inode,
 	.drop_inode	= generic_delete_inode,
@@ -25,6 +25,13 @@
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/crypto.h>
+#include <crypto/hash.h>
+#include <linux/scatterlist.h>
+#include <linux/mempool.h>
 
 /* the file system name */
 #define WRAPFS_NAME "wrapfs"
@@ -32,6 +39,35 @@
 /* wrapfs root inode number */
 #define WRAPFS_ROOT_INO     1
 
+/* bytes of key material the cipher is keyed with */
+#define WRAPFS_KEY_SIZE	32
+/* most pages handed to one crypto call or one lower read/write */
+#define WRAPFS_CRYPT_BATCH	16
+
+/* write bounce pages kept in reserve per mount unless bounce_pages=N */
+#define WRAPFS_DEFAULT_BOUNCE_PAGES	(2 * WRAPFS_CRYPT_BATCH)
+/* the most bounce_pages=N may pin, 4 MB with 4 KB pages */
+#define WRAPFS_MAX_BOUNCE_PAGES		1024
+
+/* longest name that still fits NAME_MAX once encrypted and encoded */
+#define WRAPFS_NAME_PLAIN_MAX	176
+/* NAME_MAX padded to whole cipher blocks */
+#define WRAPFS_NAME_CRYPT_MAX	256
+/*
+ * Longer names are stored as '=' and the encoded SHA-256 of their
+ * ciphertext; the ciphertext itself goes into an index file in the
+ * lower directory, for readdir.
+ */
+#define WRAPFS_LONG_NAME_PREFIX	'='
+#define WRAPFS_LONG_NAME_DIGEST	32
+#define WRAPFS_LONG_NAME_LEN	44
+#define WRAPFS_LONG_NAME_INDEX	".wrapfs_longnames"
+/* name pairs kept in each key's translation cache, and its hash size */
+#define WRAPFS_NAME_CACHE_SIZE	1024
+#define WRAPFS_NAME_HASH_BITS	8
+/* bytes per chunk of a cached directory listing */
+#define WRAPFS_DIR_CHUNK_SIZE	(4 * PAGE_SIZE)
+
 /* useful for tracking code reachability */
 #define UDBG printk(KERN_DEFAULT "DBG:%s:%s:%d\n", __FILE__, __func__, __LINE__)
 
@@ -51,6 +87,37 @@ extern int debug_opt;
 #endif
 extern int wrapfs_mmap_opt;
 
+/*
+ * Options of one mount, parsed on wrapfs_mount()'s stack and handed to
+ * read_super with the lower path, so concurrent mounts can't see each
+ * other's.
+ */
+struct wrapfs_mount_opts {
+	int cipher;			/* index into wrapfs_cipher_modes */
+	int bounce_pages;		/* 0 for the default */
+	bool encnames;
+	bool async;
+	bool nocache_lower;
+};
+
+struct wrapfs_mount_data {
+	const char *dev_name;
+	struct wrapfs_mount_opts opts;
+};
+
+/*
+ * Copy a range of another file of the mount into the file the ioctl is
+ * issued on, without decrypting and re-encrypting when the layout lets
+ * the ciphertext be copied as it is.  Returns the bytes copied.
+ */
+struct wrapfs_copy_range {
+	__s64 src_fd;
+	__u64 src_offset;
+	__u64 dst_offset;
+	__u64 len;
+};
+#define WRAPFS_IOC_COPY_RANGE	_IOW('W', 2, struct wrapfs_copy_range)
+
 /* operations vectors defined in specific files */
 extern const struct file_operations wrapfs_main_fops;
 extern const struct file_operations wrapfs_main_fops_add_space;
@@ -59,9 +126,10 @@ extern const struct inode_operations wrapfs_main_iops;
 extern const struct inode_operations wrapfs_dir_iops;
 extern const struct inode_operations wrapfs_symlink_iops;
 extern const struct super_operations wrapfs_sops;
-extern const struct dentry_operations wrapfs_dops;
+extern const struct dentry_operations wrapfs_dops, wrapfs_dops_noreval;
 extern const struct address_space_operations wrapfs_aops, wrapfs_dummy_aops;
 extern const struct vm_operations_struct wrapfs_vm_ops;
+extern const struct vm_operations_struct wrapfs_vm_ops_add_space;
 
 extern int wrapfs_init_inode_cache(void);
 extern void wrapfs_destroy_inode_cache(void);
@@ -69,22 +137,167 @@ extern int wrapfs_init_dentry_cache(void);
 extern void wrapfs_destroy_dentry_cache(void);
 extern int new_dentry_private_data(struct dentry *dentry);
 extern void free_dentry_private_data(struct dentry *dentry);
+extern void wrapfs_set_d_op(struct dentry *dentry,
+			    struct dentry *lower_dentry);
 extern struct dentry *wrapfs_lookup(struct inode *dir, struct dentry *dentry,
 				    struct nameidata *nd);
 extern struct inode *wrapfs_iget(struct super_block *sb,
 				 struct inode *lower_inode);
 extern int wrapfs_interpose(struct dentry *dentry, struct super_block *sb,
 			    struct path *lower_path);
+extern int wrapfs_get_lower_file(struct dentry *dentry, struct inode *inode,
+				 fmode_t mode);
+extern void wrapfs_put_lower_file(struct inode *inode);
+extern int wrapfs_truncate(struct dentry *dentry, loff_t new_length,
+			   struct file *file);
+extern int wrapfs_zero_range(struct inode *inode, loff_t from, loff_t to,
+			     struct file *file);
+extern ssize_t wrapfs_copy_range(struct file *src, loff_t src_off,
+				 struct file *dst, loff_t dst_off, size_t len);
+#ifdef WRAPFS_CRYPTO
+struct wrapfs_dir_chunk;
+struct wrapfs_dir_cache;
+struct wrapfs_long_name;
+struct wrapfs_long_names;
+extern int wrapfs_crypt_init(struct super_block *sb,
+			     const struct wrapfs_mount_opts *opts);
+extern void wrapfs_crypt_destroy(struct super_block *sb);
+extern int wrapfs_crypt_setkey(struct super_block *sb, const u8 *key,
+			       unsigned int key_len);
+extern void wrapfs_crypt_clearkey(struct super_block *sb);
+extern unsigned int wrapfs_get_bounce_pages(struct super_block *sb,
+					    struct page **pages,
+					    unsigned int nr_pages);
+extern void wrapfs_put_bounce_pages(struct super_block *sb,
+				    struct page **pages,
+				    unsigned int nr_pages);
+extern int wrapfs_cipher_lookup(const char *name);
+extern int wrapfs_crypt_sg(struct inode *inode, pgoff_t index,
+			   struct scatterlist *dst, struct scatterlist *src,
+			   unsigned int nr_pages, int encrypt);
+extern int wrapfs_crypt_page_range(struct inode *inode,
+				   struct page **src_pages,
+				   struct page **dst_pages,
+				   unsigned int nr_pages,
+				   size_t from, size_t to, int encrypt);
+extern int wrapfs_crypt_pages(struct inode *inode, struct page **src_pages,
+			      struct page **dst_pages, unsigned int nr_pages,
+			      int encrypt);
+extern int decrypt_encrypt_page(struct inode *inode,
+				struct page *src_page,
+				struct page *dst_page,
+				int encrypt);
+extern int wrapfs_encrypt_name(struct super_block *sb, const char *name,
+			       unsigned int len, char *lower_name);
+extern int wrapfs_decrypt_name(struct super_block *sb, const char *lower_name,
+			       unsigned int len, char *name);
+extern int wrapfs_encrypt_long_name(struct super_block *sb,
+				    const char *name, unsigned int len,
+				    struct wrapfs_long_name *rec);
+extern int wrapfs_decrypt_dirents(struct super_block *sb,
+				  struct wrapfs_dir_chunk *chunk,
+				  struct wrapfs_long_names *names);
+extern int __wrapfs_long_name_add(struct dentry *dentry,
+				  struct dentry *lower_dir,
+				  struct vfsmount *lower_mnt);
+extern void __wrapfs_long_name_remove(struct dentry *dentry,
+				      struct dentry *lower_dir,
+				      struct vfsmount *lower_mnt);
+extern struct wrapfs_long_names *wrapfs_long_names_load(
+	struct super_block *sb, struct path *lower_dir);
+extern const struct wrapfs_long_name *wrapfs_long_names_find(
+	struct wrapfs_long_names *names, const u8 *digest);
+extern void wrapfs_long_names_free(struct wrapfs_long_names *names);
+extern int __wrapfs_long_name_index_remove(struct super_block *sb,
+					   struct path *lower_path);
+extern void wrapfs_dir_cache_put(struct wrapfs_dir_cache *cache);
+extern void wrapfs_dir_cache_drop(struct inode *dir);
+extern int wrapfs_crypt_page_async(struct inode *inode,
+				   struct page *src_page,
+				   struct page *dst_page, int encrypt,
+				   void (*done)(void *data, int err),
+				   void *data);
+#endif
+
+#ifdef WRAPFS_CRYPTO
+/* a directory entry with its name decrypted; namlen 0 if it has none */
+struct wrapfs_dirent {
+	u64 ino;
+	unsigned short reclen;		/* to the next entry */
+	unsigned short namlen;
+	unsigned char d_type;
+	char name[];			/* not NUL terminated */
+};
+
+struct wrapfs_dir_chunk {
+	struct list_head list;
+	size_t used;
+	char data[];
+};
+
+/*
+ * The decrypted listing of an encnames directory, built by one pass of
+ * lower readdir and kept on the inode until the lower directory or the
+ * key changes.  An open directory holds on to the listing it started
+ * reading, so positions stay put while a new one is built.
+ */
+struct wrapfs_dir_cache {
+	atomic_t count;
+	u64 version;			/* lower i_version when built */
+	struct timespec mtime;		/* lower mtime when built */
+	long key_gen;			/* setkeys count when built */
+	struct list_head chunks;
+};
+
+/*
+ * A record of a lower directory's long name index, which keeps them in
+ * fixed-size slots of a hash table on disk.  One torn by a crash fails
+ * the digest check in readdir.
+ */
+struct wrapfs_long_name {
+	u8 digest[WRAPFS_LONG_NAME_DIGEST];	/* in the lower name */
+	__le16 len;				/* of the encrypted name */
+	u8 name[WRAPFS_NAME_CRYPT_MAX];
+} __packed;
+
+/* the live records of a long name index, hashed by digest */
+struct wrapfs_long_names {
+	struct wrapfs_long_name *recs;
+	unsigned int nr;
+	unsigned int mask;
+	const struct wrapfs_long_name **slots;
+};
+#endif
 
 /* file private data */
 struct wrapfs_file_info {
 	struct file *lower_file;
 	const struct vm_operations_struct *lower_vm_ops;
+#ifdef WRAPFS_CRYPTO
+	/* readdir cursor in the listing this open directory is reading */
+	struct wrapfs_dir_cache *dir_cache;
+	struct wrapfs_dir_chunk *dir_chunk;	/* NULL at the end */
+	size_t dir_off;
+	loff_t dir_pos;
+#endif
 };
 
 /* wrapfs inode data in memory */
 struct wrapfs_inode_info {
 	struct inode *lower_inode;
+	/*
+	 * Lower file shared by all opens of a regular file, for page I/O
+	 * that has no struct file of its own (writeback).  Opened by the
+	 * first open, dropped after the last release has flushed.
+	 */
+	struct mutex lower_file_mutex;	/* serializes open/release */
+	spinlock_t lower_file_lock;	/* protects lower_file */
+	int lower_file_count;
+	struct file *lower_file;
+#ifdef WRAPFS_CRYPTO
+	/* a directory's decrypted listing; under i_mutex */
+	struct wrapfs_dir_cache *dir_cache;
+#endif
 	struct inode vfs_inode;
 };
 
@@ -92,12 +305,112 @@ struct wrapfs_inode_info {
 struct wrapfs_dentry_info {
 	spinlock_t lock;	/* protects lower_path */
 	struct path lower_path;
+	struct rcu_head rcu;	/* rcu-walk may still be reading us */
 };
 
+/* per-mount counters, reported through /proc/self/mountstats */
+struct wrapfs_stats {
+	atomic_long_t tfm_allocs;	/* cipher transforms allocated */
+	atomic_long_t tfm_frees;	/* cipher transforms freed */
+	atomic_long_t setkeys;		/* successful key changes */
+	atomic_long_t pages_encrypted;
+	atomic_long_t pages_decrypted;
+	atomic_long_t async_submitted;	/* requests handed to the async tfm */
+	atomic_long_t async_fallbacks;	/* async wanted, done synchronously */
+	atomic_long_t bounce_in_use;	/* write bounce pages handed out */
+	atomic_long_t bounce_high_water;
+	atomic_long_t bounce_waits;	/* allocations that had to sleep */
+	atomic_long_t lower_dropped;	/* lower pages dropped by nocache_lower */
+	atomic_long_t name_hits;	/* names found in the name cache */
+	atomic_long_t name_misses;	/* names run through the cipher */
+};
+
+#ifdef WRAPFS_CRYPTO
+/*
+ * A cipher= choice: the algorithm, and how each page's IV is derived
+ * from the inode number, the page index and the counter block at which
+ * the operation starts inside the page.
+ */
+struct wrapfs_cipher_mode {
+	const char *name;		/* cipher= value */
+	const char *algo;		/* crypto API algorithm */
+	/* bytes per counter step; 0 if the stream can't start mid-page */
+	unsigned int ctr_block;
+	void (*make_iv)(u8 *iv, unsigned int ivsize, u64 ino,
+			pgoff_t index, unsigned int block);
+	/* does the keystream depend on the inode and the page index? */
+	bool per_file_iv;
+	/* does the IV only hold 32 bits of each? */
+	bool iv32;
+};
+
+/* a plaintext name and its lower name, in a key's name cache */
+struct wrapfs_name_ent {
+	struct hlist_node plain_node;
+	struct hlist_node lower_node;
+	struct list_head lru;
+	unsigned int plain_len;
+	unsigned int lower_len;
+	char *lower;			/* after the plaintext in name[] */
+	char name[];
+};
+
+/*
+ * Names translated with a key, hashed both ways: lookup and create go
+ * from plaintext to lower names, readdir the other way.  At most
+ * WRAPFS_NAME_CACHE_SIZE pairs; the least recently used one goes.
+ */
+struct wrapfs_name_cache {
+	spinlock_t lock;
+	struct hlist_head plain[1 << WRAPFS_NAME_HASH_BITS];
+	struct hlist_head lower[1 << WRAPFS_NAME_HASH_BITS];
+	struct list_head lru;		/* most recently used first */
+	unsigned int nr;
+};
+
+/*
+ * A key and the transforms keyed with it: one per possible cpu, set up
+ * when the key ioctl runs, so the page path never has to allocate or
+ * key a transform itself.  The page path finds it under RCU and never
+ * blocks a key change; the mount holds one reference and each in-flight
+ * async request another, and the last one frees it after a grace period.
+ */
+struct wrapfs_key {
+	atomic_t count;
+	struct super_block *sb;
+	struct crypto_blkcipher * __percpu *tfms;
+	struct crypto_ablkcipher *atfm;	/* NULL unless mounted with async */
+	/* NULL unless mounted with encnames */
+	struct crypto_blkcipher *name_tfm;
+	struct crypto_shash *name_hash;
+	struct wrapfs_name_cache *names;
+	struct rcu_head rcu;
+	struct work_struct free_work;	/* freeing may sleep */
+	u8 raw[WRAPFS_KEY_SIZE];
+};
+
+/* Per-mount cipher state */
+struct wrapfs_crypt_ctx {
+	const struct wrapfs_cipher_mode *mode;	/* fixed at mount */
+	struct wrapfs_key __rcu *key;	/* NULL until the key ioctl */
+	struct mutex key_mutex;		/* serializes key changes */
+	bool encnames;			/* fixed at mount */
+	bool async;			/* fixed at mount */
+	const struct cred *mounter_cred;	/* long name indexes' owner */
+};
+#endif
+
 /* wrapfs super-block data in memory */
 struct wrapfs_sb_info {
 	struct super_block *lower_sb;
-	char key[33];
+	bool nocache_lower;		/* fixed at mount */
+#ifdef WRAPFS_CRYPTO
+	struct wrapfs_crypt_ctx crypt;
+	/* bounce pages for ciphertext on the write path */
+	mempool_t *bounce_pool;
+	int bounce_reserve;
+#endif
+	struct wrapfs_stats stats;
 };
 
 /*
@@ -143,6 +456,95 @@ static inline void wrapfs_set_lower_inode(struct inode *i, struct inode *val)
 	WRAPFS_I(i)->lower_inode = val;
 }
 
+/* inode to its shared lower file, or NULL.  Caller must fput it. */
+static inline struct file *wrapfs_get_inode_lower_file(struct inode *i)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(i);
+	struct file *lower_file;
+
+	spin_lock(&info->lower_file_lock);
+	lower_file = info->lower_file;
+	if (lower_file)
+		get_file(lower_file);
+	spin_unlock(&info->lower_file_lock);
+	return lower_file;
+}
+
+/* has the key ioctl set a key on this mount? */
+static inline bool wrapfs_has_key(struct super_block *sb)
+{
+#ifdef WRAPFS_CRYPTO
+	return rcu_access_pointer(WRAPFS_SB(sb)->crypt.key) != NULL;
+#else
+	return false;
+#endif
+}
+
+/* are names encrypted on the lower file system? */
+static inline bool wrapfs_encnames(struct super_block *sb)
+{
+#ifdef WRAPFS_CRYPTO
+	return WRAPFS_SB(sb)->crypt.encnames;
+#else
+	return false;
+#endif
+}
+
+/* @dir's entries changed through us: its cached listing is stale */
+static inline void wrapfs_dir_changed(struct inode *dir)
+{
+#ifdef WRAPFS_CRYPTO
+	wrapfs_dir_cache_drop(dir);
+#endif
+}
+
+/*
+ * About to give @dentry a lower entry in @lower_dir, which is locked:
+ * if its name is a long one, make sure the directory's index has it.
+ * Returns 1 if that added a record, which wrapfs_long_name_remove()
+ * must take back if the lower entry is not made.
+ */
+static inline int wrapfs_long_name_add(struct dentry *dentry,
+				       struct dentry *lower_dir,
+				       struct vfsmount *lower_mnt)
+{
+#ifdef WRAPFS_CRYPTO
+	if (wrapfs_encnames(dentry->d_sb) &&
+	    dentry->d_name.len > WRAPFS_NAME_PLAIN_MAX)
+		return __wrapfs_long_name_add(dentry, lower_dir, lower_mnt);
+#endif
+	return 0;
+}
+
+/*
+ * @dentry's lower entry has left @lower_dir, which is locked: if its name
+ * is a long one, drop it from the directory's index.
+ */
+static inline void wrapfs_long_name_remove(struct dentry *dentry,
+					   struct dentry *lower_dir,
+					   struct vfsmount *lower_mnt)
+{
+#ifdef WRAPFS_CRYPTO
+	if (wrapfs_encnames(dentry->d_sb) &&
+	    dentry->d_name.len > WRAPFS_NAME_PLAIN_MAX)
+		__wrapfs_long_name_remove(dentry, lower_dir, lower_mnt);
+#endif
+}
+
+/*
+ * About to remove the lower directory @lower_path, whose parent is
+ * locked: its long name index must go first, if that is all it holds.
+ */
+static inline int wrapfs_long_name_index_remove(struct super_block *sb,
+						struct path *lower_path)
+{
+#ifdef WRAPFS_CRYPTO
+	if (wrapfs_encnames(sb))
+		return __wrapfs_long_name_index_remove(sb, lower_path);
+#endif
+	return 0;
+}
+
 /* superblock to lower superblock */
 static inline struct super_block *wrapfs_lower_super(
 	const struct super_block *sb)
@@ -172,6 +574,18 @@ static inline void wrapfs_get_lower_path(const struct dentry *dent,
 	spin_unlock(&WRAPFS_D(dent)->lock);
 	return;
 }
+/*
+ * The lower path is set before a dentry is hashed and only reset by
+ * ->d_release, and the dentry holds a reference to it all along.  A
+ * caller holding a reference to @dent can therefore use it without the
+ * lock and without references of its own: no atomics on the shared lower
+ * dentry and mount.  Use wrapfs_get_lower_path() to hand references on.
+ */
+static inline void wrapfs_borrow_lower_path(const struct dentry *dent,
+					    struct path *lower_path)
+{
+	pathcpy(lower_path, &WRAPFS_D(dent)->lower_path);
+}
 static inline void wrapfs_put_lower_path(const struct dentry *dent,
 					 struct path *lower_path)
 {